@@ -0,0 +1,30 @@
+/* 
+ * myburn.c - A CPU-bound program for load testing your tiny shell
+ * 
+ * usage: myburn <n>
+ * Keeps a CPU busy for <n> seconds without ever sleeping.
+ *
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <time.h>
+
+int main(int argc, char **argv) 
+{
+    int secs;
+    time_t end;
+    volatile unsigned long spins = 0;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <n>\n", argv[0]);
+	exit(0);
+    }
+    secs = atoi(argv[1]);
+
+    end = time(NULL) + secs;
+    while (time(NULL) < end)
+	spins++;
+
+    exit(0);
+}
@@ -0,0 +1,149 @@
+/*
+ * myclient.c - Talks to a tiny shell running as a job daemon (tsh -d)
+ *
+ * usage: myclient <socket> <request ...>
+ *        myclient -n <count> <socket> <cmdline ...>
+ * The first form sends one request and prints the reply. It exits
+ * with status 1 if the daemon replied with an error.
+ *
+ * The second form submits <cmdline> <count> times, keeping up to
+ * WINDOW jobs in flight and waiting for the oldest when the window
+ * or the daemon's job table is full, then reports the rate.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+
+#define WINDOW     8 /* jobs in flight when submitting <count> jobs */
+
+FILE *reader;        /* replies from the daemon */
+char *reply;         /* last reply line, grown by getline */
+size_t replycap;
+
+/*
+ * nextreply - Read the next reply line into reply
+ */
+void nextreply(void)
+{
+    if (getline(&reply, &replycap, reader) < 0) {
+	fprintf(stderr, "myclient: connection closed\n");
+	exit(2);
+    }
+}
+
+/*
+ * request - Send a request line and read the first line of the reply.
+ *     The line must have room for one more character.
+ */
+void request(int fd, char *line)
+{
+    size_t len = strlen(line);
+    size_t done = 0;
+    ssize_t rc;
+
+    line[len] = '\n';
+    while (done < len + 1) {
+	if ((rc = write(fd, line + done, len + 1 - done)) < 0) {
+	    perror("write");
+	    exit(2);
+	}
+	done += rc;
+    }
+    line[len] = '\0';
+    nextreply();
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_un addr;
+    struct timeval start, end;
+    char *line, *cmd;
+    size_t cmdlen = 0;
+    pid_t inflight[WINDOW];
+    int fd, i, n = 0, count = 0, head = 0, full = 0, jid;
+    double secs;
+
+    if (argc > 2 && !strcmp(argv[1], "-n")) {
+	count = atoi(argv[2]);
+	argv += 2;
+	argc -= 2;
+    }
+    if (argc < 3) {
+	fprintf(stderr, "Usage: %s [-n <count>] <socket> <request ...>\n", argv[0]);
+	exit(2);
+    }
+    for (i = 2; i < argc; i++)
+	cmdlen += strlen(argv[i]) + 1;
+    /* room for "submit ", the newline and a pid for "wait" */
+    if ((cmd = malloc(cmdlen + 1)) == NULL ||
+	(line = malloc(cmdlen + 32)) == NULL) {
+	perror("malloc");
+	exit(2);
+    }
+    cmd[0] = '\0';
+    for (i = 2; i < argc; i++) {
+	strcat(cmd, argv[i]);
+	if (i < argc - 1)
+	    strcat(cmd, " ");
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, argv[1], sizeof(addr.sun_path) - 1);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+	perror(argv[1]);
+	exit(2);
+    }
+    reader = fdopen(fd, "r");
+
+    /* one request: print the reply, list entries and all */
+    if (count == 0) {
+	strcpy(line, cmd);
+	request(fd, line);
+	fputs(reply, stdout);
+	while (!strncmp(reply, "job ", 4)) {
+	    nextreply();
+	    fputs(reply, stdout);
+	}
+	exit(strncmp(reply, "err", 3) == 0);
+    }
+
+    /* submit <count> jobs, then wait for the last of them */
+    gettimeofday(&start, NULL);
+    for (i = 0; i < count; i++) {
+	sprintf(line, "submit %s", cmd);
+	request(fd, line);
+	if (!strcmp(reply, "err job table full\n")) {
+	    if (n == 0) /* the table is full of other clients' jobs */
+		usleep(1000);
+	    full = 1;
+	    i--;
+	}
+	else if (strncmp(reply, "ok ", 3)) {
+	    fprintf(stderr, "myclient: %s", reply);
+	    exit(1);
+	}
+	else if (sscanf(reply, "ok %d %d", &jid, &inflight[(head + n) % WINDOW]) == 2 && jid)
+	    n++;
+
+	/* wait for the oldest job when out of room, and at the end */
+	while (n > 0 && (n == WINDOW || full || i == count - 1)) {
+	    sprintf(line, "wait %d", inflight[head]);
+	    request(fd, line);
+	    head = (head + 1) % WINDOW;
+	    n--;
+	    full = 0;
+	}
+	full = 0;
+    }
+    gettimeofday(&end, NULL);
+
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+    printf("%d jobs in %.2fs, %.0f jobs/s\n", count, secs, count / secs);
+    exit(0);
+}
@@ -0,0 +1,42 @@
+/* 
+ * myfan.c - Builds a process tree for load testing your tiny shell
+ * 
+ * usage: myfan <depth> <width> <n>
+ * Each process down to <depth> levels forks <width> children and waits
+ * for them. The leaves spin for <n> seconds in 1-second chunks, so the
+ * job holds width + width^2 + ... + width^depth descendants.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+int main(int argc, char **argv) 
+{
+    int i, depth, width, secs;
+
+    if (argc != 4) {
+	fprintf(stderr, "Usage: %s <depth> <width> <n>\n", argv[0]);
+	exit(0);
+    }
+    depth = atoi(argv[1]);
+    width = atoi(argv[2]);
+    secs = atoi(argv[3]);
+
+    while (depth-- > 0) {
+	for (i = 0; i < width; i++)
+	    if (fork() == 0) /* child carries on one level down */
+		break;
+	if (i == width) { /* parent waits for its children */
+	    while (wait(NULL) > 0)
+		;
+	    exit(0);
+	}
+    }
+
+    /* leaf */
+    for (i=0; i < secs; i++)
+	sleep(1);
+    exit(0);
+}
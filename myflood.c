@@ -0,0 +1,38 @@
+/* 
+ * myflood.c - A heavy stdout writer for load testing your tiny shell
+ * 
+ * usage: myflood <n>
+ * Writes <n> megabytes of 64-byte lines to stdout as fast as it can.
+ *
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LINELEN 64
+#define BUFLINES 1024
+
+int main(int argc, char **argv) 
+{
+    int i, lines, mbytes;
+    char buf[LINELEN * BUFLINES];
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <n>\n", argv[0]);
+	exit(0);
+    }
+    mbytes = atoi(argv[1]);
+
+    memset(buf, 'x', sizeof(buf));
+    for (i = LINELEN-1; i < sizeof(buf); i += LINELEN)
+	buf[i] = '\n';
+
+    /* 1MB is exactly 16 buffers of 1024 64-byte lines */
+    for (lines = 0; lines < mbytes * 16; lines++)
+	if (write(STDOUT_FILENO, buf, sizeof(buf)) < 0) {
+	    perror("write");
+	    exit(1);
+	}
+    exit(0);
+}
@@ -0,0 +1,13 @@
+/* 
+ * mynull.c - The cheapest possible job, for measuring spawn rate
+ * 
+ * usage: mynull
+ * Exits immediately.
+ *
+ */
+#include <stdlib.h>
+
+int main(int argc, char **argv) 
+{
+    exit(0);
+}
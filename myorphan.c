@@ -0,0 +1,31 @@
+/* 
+ * myorphan.c - Leaves an orphan behind for testing your tiny shell
+ * 
+ * usage: myorphan <n>
+ * Fork a child that spins for <n> seconds in 1-second chunks, then
+ * exit immediately so that the child is reparented.
+ */
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <sys/types.h>
+
+int main(int argc, char **argv) 
+{
+    int i, secs;
+
+    if (argc != 2) {
+	fprintf(stderr, "Usage: %s <n>\n", argv[0]);
+	exit(0);
+    }
+    secs = atoi(argv[1]);
+
+    if (fork() == 0) { /* child */
+	for (i=0; i < secs; i++)
+	    sleep(1);
+	exit(0);
+    }
+
+    /* parent exits without waiting for the child */
+    exit(0);
+}
@@ -0,0 +1,371 @@
+#!/usr/bin/perl
+use Getopt::Std;
+use FileHandle;
+use IPC::Open2;
+use Time::HiRes qw(time sleep);
+
+#######################################################################
+# stress.pl - Shell stress and load driver
+#
+# Runs a shell program as a child, the same way sdriver.pl does, and
+# hammers it with thousands of jobs and signal storms. After every
+# round it asks the shell for its job list and checks the job table
+# invariants. Throughput and reap latency are reported on stdout.
+#
+# Phases:
+#     spawn       Run <n> ./mynull jobs back to back in the foreground
+#     latency     Time the round trip of single foreground ./mynull jobs
+#     churn       Run <n> ./mynull jobs in the background in batches
+#     storm       Interrupt and stop foreground jobs at random moments
+#     flood       Push megabytes of job output through the shell
+#     after       Chain jobs with "after", kill some of the jobs the
+#                 chains wait for, and check that every waiting job
+#                 starts or is dropped
+#     fan         Under -r, orphan the descendants of process trees by
+#                 killing their roots, and check that the shell reaps
+#                 them all before it lets go of their jobs
+#
+# Job table invariants checked after each round:
+#     - every line of "jobs" output is well formed
+#     - no job is in the Foreground state while the shell is idle
+#     - job IDs and PIDs are unique, and at most MAXJOBS jobs exist
+#     - Waiting jobs, and only they, are listed with PID 0
+#     - every Stopped job is still alive
+#     - the shell never reports an internal error
+#     - under -r, no process of a job's group outlives the job
+#
+# The driver exits with status 1 on the first violation.
+#
+######################################################################
+
+$MAXJOBS = 16;      # size of the shell's job table
+$BATCH = 8;         # background jobs launched between checks
+$TIMEOUT = 30;      # seconds before an unanswered marker is a hang
+$FANS = 4;          # process trees launched per fan round
+$FANTREE = "2 4 1"; # their depth, width and seconds: 20 descendants each
+$CHAIN = 3;         # jobs chained behind each job in an after round
+
+#
+# usage - print help message and terminate
+#
+sub usage
+{
+    printf STDERR "$_[0]\n";
+    printf STDERR "Usage: $0 [-hv] -s <shellprog> -a <args> [-n <jobs>]\n";
+    printf STDERR "Options:\n";
+    printf STDERR "  -h            Print this message\n";
+    printf STDERR "  -v            Be more verbose\n";
+    printf STDERR "  -s <shell>    Shell program to test\n";
+    printf STDERR "  -a <args>     Shell arguments\n";
+    printf STDERR "  -n <jobs>     Jobs per phase (default 2000)\n";
+    die "\n" ;
+}
+
+#
+# start - run the shell program as a child with the given arguments
+#
+sub start
+{
+    $pid = open2(\*Reader, \*Writer, "$shellprog $_[0]");
+    Writer->autoflush();
+}
+
+#
+# stop - ask the shell to quit and reap it
+#
+sub stop
+{
+    &tell("quit");
+    close Writer;
+    waitpid($pid, 0);
+}
+
+#
+# fail - report an invariant violation and terminate
+#
+sub fail
+{
+    print "FAIL: $_[0]\n";
+    kill 'KILL', $pid;
+    exit(1);
+}
+
+#
+# tell - pass a command line to the shell
+#
+sub tell
+{
+    if ($verbose) {
+	print "$0: Sending :$_[0]: to child $pid\n";
+    }
+    print Writer "$_[0]\n";
+}
+
+#
+# sync - Wait until the shell has executed everything sent so far and
+#     return the lines it printed in the meantime. The shell runs
+#     commands in order, so the echo of a fresh marker means that all
+#     earlier commands have completed.
+#
+sub sync
+{
+    my ($mark, @lines, $line);
+
+    $mark = "MARK " . ++$nmarks;
+    &tell("/bin/echo $mark");
+
+    local $SIG{ALRM} = sub { fail("shell hung waiting for $mark"); };
+    alarm $TIMEOUT;
+    while (defined($line = <Reader>)) {
+	chomp($line);
+	last if ($line eq $mark);
+	if ($line =~ /No such child|waitpid error|Fatal|Internal error|Tried to create too many jobs/) {
+	    fail("shell reported \"$line\"");
+	}
+	push @lines, $line unless ($discard);
+    }
+    alarm 0;
+    defined($line)
+	or fail("shell exited waiting for $mark");
+    return @lines;
+}
+
+#
+# checkjobs - Ask the shell for its job list, check the job table
+#     invariants and return the list as (jid, pid, state) triples
+#
+sub checkjobs
+{
+    my (@jobs, %jids, %pids, $line);
+
+    &tell("jobs");
+    foreach $line (&sync()) {
+	if ($line !~ /^\[(\d+)\] \((\d+)\) (Running|Stopped|Foreground|Waiting) /) {
+	    next if ($line =~ /^Job \[\d+\] \(\d+\) (stopped|terminated) by signal/);
+	    next if ($line =~ /^\[\d+\] \(\d+\) after |^Job \[\d+\] not run: /);
+	    fail("malformed job list entry \"$line\"");
+	}
+	my ($jid, $pid, $state) = ($1, $2, $3);
+	fail("job [$jid] is in the foreground while the shell is idle")
+	    if ($state eq "Foreground");
+	fail("job [$jid] is $state with PID $pid")
+	    if (($state eq "Waiting") != ($pid == 0));
+	fail("duplicate job ID $jid") if ($jids{$jid}++);
+	fail("duplicate PID $pid") if ($pid && $pids{$pid}++);
+	fail("stopped job [$jid] ($pid) no longer exists")
+	    if ($state eq "Stopped" && !kill(0, $pid));
+	push @jobs, [$jid, $pid, $state];
+    }
+    fail(scalar(@jobs) . " jobs exceed the table size of $MAXJOBS")
+	if (@jobs > $MAXJOBS);
+    return @jobs;
+}
+
+#
+# killstopped - Get rid of stopped jobs so the job table doesn't fill up
+#
+sub killstopped
+{
+    my ($job);
+
+    foreach $job (@_) {
+	if ($job->[2] eq "Stopped") {
+	    kill 'TERM', -$job->[1];
+	    kill 'CONT', -$job->[1];
+	}
+    }
+}
+
+#
+# report - print one line of results
+#
+sub report
+{
+    printf "%-8s %s\n", "$_[0]:", $_[1];
+}
+
+# Parse the command line arguments
+getopts('hvs:a:n:');
+if ($opt_h) {
+    usage();
+}
+if (!$opt_s) {
+    usage("Missing required -s argument");
+}
+$verbose = $opt_v;
+$shellprog = $opt_s;
+$shellargs = $opt_a;
+$njobs = $opt_n ? $opt_n : 2000;
+
+# Make sure the shell program exists and is executable
+-x $shellprog
+    or die "$0: ERROR: $shellprog is not executable\n";
+
+&start($shellargs);
+srand(213);
+
+#
+# spawn - launch rate of foreground jobs
+#
+$start = time;
+for ($i = 0; $i < $njobs; $i++) {
+    &tell("./mynull");
+}
+&sync();
+$elapsed = time - $start;
+checkjobs();
+report("spawn", sprintf("%d jobs in %.2fs, %.0f jobs/s",
+			$njobs, $elapsed, $njobs / $elapsed));
+
+#
+# latency - time from launching a foreground job until it is reaped
+#     and the shell is ready for more input
+#
+@rtt = ();
+for ($i = 0; $i < $njobs / 10; $i++) {
+    $start = time;
+    &tell("./mynull");
+    &sync();
+    push @rtt, time - $start;
+}
+@rtt = sort { $a <=> $b } @rtt;
+report("latency", sprintf("min %.2fms median %.2fms p99 %.2fms max %.2fms",
+			  1000 * $rtt[0], 1000 * $rtt[@rtt / 2],
+			  1000 * $rtt[int(@rtt * 0.99)], 1000 * $rtt[-1]));
+
+#
+# churn - background jobs that come and go while the shell keeps
+#     adding new ones
+#
+$start = time;
+for ($i = 0; $i < $njobs; $i += $BATCH) {
+    for ($j = 0; $j < $BATCH; $j++) {
+	&tell("./mynull &");
+    }
+    &sync();
+    checkjobs();
+}
+$elapsed = time - $start;
+report("churn", sprintf("%d jobs in %.2fs, %.0f jobs/s",
+			$njobs, $elapsed, $njobs / $elapsed));
+
+#
+# storm - SIGINT and SIGTSTP land on the shell at random points in
+#     the life of a foreground job, and in bursts while it is idle
+#
+$nstopped = $nint = 0;
+for ($i = 0; $i < $njobs / 20; $i++) {
+    &tell($i % 2 ? "./myspin 1" : "./myburn 1");
+    sleep(rand(0.02));
+    if (rand() < 0.5) {
+	kill 'INT', $pid;
+	$nint++;
+    }
+    else {
+	kill 'TSTP', $pid;
+	$nstopped++;
+    }
+    &sync();
+    for ($j = 0; $j < 10; $j++) {
+	kill(rand() < 0.5 ? 'INT' : 'TSTP', $pid);
+    }
+    killstopped(checkjobs());
+}
+&sync();
+checkjobs();
+report("storm", sprintf("%d jobs, %d interrupted, %d stopped, invariants held",
+			$njobs / 20, $nint, $nstopped));
+
+#
+# flood - output throughput of a job writing through the shell's stdout
+#
+$discard = 1;
+$start = time;
+&tell("./myflood 64");
+&sync();
+$elapsed = time - $start;
+$discard = 0;
+checkjobs();
+report("flood", sprintf("64MB in %.2fs, %.1f MB/s", $elapsed, 64 / $elapsed));
+
+#
+# after - two chains of jobs per round, each waiting for the one
+#     before it. The first chain's root is killed, so its jobs must be
+#     dropped; the second chain's jobs must all start in turn.
+#
+$nwaiting = 0;
+$start = time;
+for ($i = 0; $i < $njobs / 400 || $i < 1; $i++) {
+    @roots = ();
+    for ($j = 0; $j < 2; $j++) {
+	&tell("./myspin 1 &");
+	(($jid, $root) = (&sync())[-1] =~ /^\[(\d+)\] \((\d+)\) /)
+	    or fail("no job started for ./myspin 1 &");
+	push @roots, $root;
+	for ($k = 0; $k < $CHAIN; $k++) {
+	    &tell("after %$jid -- ./mynull");
+	    (($jid) = (&sync())[-1] =~ /^\[(\d+)\] \(0\) after /)
+		or fail("no waiting job created for after %$jid");
+	}
+    }
+    @waiting = grep { $_->[2] eq "Waiting" } checkjobs();
+    fail(scalar(@waiting) . " jobs waiting instead of " . 2 * $CHAIN)
+	if (@waiting != 2 * $CHAIN);
+    $nwaiting += @waiting;
+    kill 'KILL', $roots[0];
+    while (checkjobs()) {
+	fail("waiting jobs still listed after ${TIMEOUT}s")
+	    if (time - $start > $TIMEOUT * ($i + 1));
+	sleep(0.05);
+    }
+}
+report("after", sprintf("%d jobs waited, all started or dropped in %.2fs",
+			$nwaiting, time - $start));
+
+#
+# fan - a subreaping shell inherits the descendants of the trees whose
+#     roots are killed. Each job must be listed until its whole process
+#     group is gone, zombies included, and then no longer.
+#
+&stop();
+&start("$shellargs -r");
+$ntrees = $nkilled = 0;
+$start = time;
+for ($i = 0; $i < $njobs / 400 || $i < 1; $i++) {
+    for ($j = 0; $j < $FANS; $j++) {
+	&tell("./myfan $FANTREE &");
+    }
+    &sync();
+    @fans = checkjobs();
+    sleep(0.2);			# let the trees grow before orphaning them
+    for ($j = 0; $j < @fans; $j += 2) {
+	kill 'KILL', $fans[$j]->[1];
+	$nkilled++;
+    }
+    $ntrees += @fans;
+    sleep(0.1);
+    foreach $job (@fans) {
+	fail("tree of job [$job->[0]] ($job->[1]) was let go while its processes live")
+	    unless (grep { $_->[1] == $job->[1] } checkjobs()) || !kill(0, -$job->[1]);
+    }
+    while (@jobs = checkjobs()) {
+	%listed = map { $_->[1] => 1 } @jobs;
+	foreach $job (@fans) {
+	    fail("process group $job->[1] outlived job [$job->[0]]")
+		if (!$listed{$job->[1]} && kill(0, -$job->[1]));
+	}
+	fail("trees still running after ${TIMEOUT}s")
+	    if (time - $start > $TIMEOUT * ($i + 1));
+	sleep(0.05);
+    }
+    foreach $job (@fans) {
+	fail("process group $job->[1] outlived job [$job->[0]]")
+	    if (kill(0, -$job->[1]));
+    }
+}
+report("fan", sprintf("%d trees, %d roots killed, all descendants reaped in %.2fs",
+		      $ntrees, $nkilled, time - $start));
+
+&stop();
+print "PASS\n";
+exit(0);
@@ -0,0 +1,94 @@
+/*
+ * tokbench.c - Measures how fast the shell's parseline() splits long
+ *     command lines into words
+ *
+ * usage: tokbench [<megabytes>]
+ * Builds command lines of <megabytes> MB (default 4) of a few kinds,
+ * runs parseline() on each of them repeatedly and reports the rate in
+ * MB/s. The word count is checked against the number of words put in.
+ *
+ * The shell is compiled into this program, so "make bench" builds it
+ * twice: once as it is, and once with the SSE2 scanner turned off.
+ */
+#define main tsh_main
+#include "tsh.c"
+#undef main
+
+#define ROUNDS 20 /* parses per kind of line */
+
+/*
+ * makeline - Build a line of about size bytes out of copies of word
+ *     and return the number of words in it
+ */
+size_t makeline(char *line, size_t size, const char *word, size_t words)
+{
+    size_t len = strlen(word), n = 0, off = 0;
+
+    while (off + len + 2 < size) {
+	memcpy(line + off, word, len);
+	off += len;
+	line[off++] = ' ';
+	n += words;
+    }
+    line[off++] = '\n';
+    line[off] = '\0';
+    return n;
+}
+
+int main(int argc, char **argv)
+{
+    static const struct {
+	const char *name;
+	const char *word;
+	size_t words;   /* words in one copy of word */
+    } kinds[] = {
+	{ "plain",  "/usr/lib/libexample.so.1", 1 },
+	{ "short",  "a b c d e f g h", 8 },
+	{ "quoted", "'it''s' \"a $b\" x\\ y", 3 },
+	{ "ops",    "a;b&&c||d", 7 },
+	{ "huge",   NULL, 1 },
+    };
+    struct timeval start, end;
+    size_t size, want, got, i;
+    char *line, *word, **av;
+    double secs;
+    int k, r;
+
+    size = (argc > 1 ? atoi(argv[1]) : 4) << 20;
+    if (size == 0 || !(line = malloc(size + 2)) || !(word = malloc(size))) {
+	fprintf(stderr, "usage: %s [<megabytes>]\n", argv[0]);
+	exit(2);
+    }
+    linemax = size + 1; /* let lines longer than ARG_MAX through */
+    memset(word, 'x', size - 8);
+    word[size - 8] = '\0';
+    printf("%-8s %zu MB lines, %s scanner\n", "tokbench", size >> 20,
+#ifdef __SSE2__
+	   "SSE2"
+#else
+	   "scalar"
+#endif
+	   );
+
+    for (k = 0; k < sizeof(kinds) / sizeof(kinds[0]); k++) {
+	want = makeline(line, size, kinds[k].word ? kinds[k].word : word,
+			kinds[k].words);
+	got = 0;
+	gettimeofday(&start, NULL);
+	for (r = 0; r < ROUNDS; r++) {
+	    parseline(line, &av);
+	    for (got = 0; av[got]; got++)
+		;
+	}
+	gettimeofday(&end, NULL);
+	if (got != want) {
+	    printf("%-8s got %zu words, expected %zu\n", kinds[k].name, got, want);
+	    exit(1);
+	}
+	secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1e6;
+	i = strlen(line);
+	printf("%-8s %9zu words, %7.1f MB/s\n", kinds[k].name, got,
+	       (double)i * ROUNDS / secs / (1 << 20));
+    }
+    exit(0);
+}
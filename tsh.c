@@ -3,6 +3,7 @@
  * 
  * @author Somsubhra Bairi (201101056@daiict.ac.in)
  */
+#define _GNU_SOURCE         /* memrchr, memmem */
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -11,44 +12,276 @@
 #include <signal.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/prctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <limits.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <time.h>
 #include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /* Misc manifest constants */
-#define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
+#define MAXLINE    1024   /* initial size of line buffers */
+#define MAXARGS     128   /* initial size of argument arrays */
 #define MAXJOBS      16   /* max jobs at any point in time */
 #define MAXJID    1<<16   /* max job ID */
+#define INBUF   (1<<16)   /* bytes of input read at a time */
+
+/* History manifest constants */
+#define HISTMAGIC  0x74736869 /* "tshi", marks a history index file */
+#define HISTTAIL   1024       /* unindexed entries before a reindex */
+#define HISTBLOCK  64         /* sorted entries per newest-offset block */
+#define HISTSHOW   16         /* entries listed by a bare history */
+
+/* Expansion manifest constants */
+#define DIRCACHE   64         /* directory listings kept for globbing */
+
+/* Variable manifest constants */
+#define VARBUCKETS 256        /* hash chains holding the variables */
+#define ENVSPARE   16         /* extra envp slots beyond what is needed */
+
+/* Daemon manifest constants */
+#define MAXCLIENTS   64       /* clients connected at once */
+#define DONELOG    1024       /* finished jobs whose status is kept */
+
+/* Result cache manifest constants */
+#define CACHEMAGIC 0x74736863 /* "tshc", marks a cache entry */
+#define CACHEMAX   (64 << 20) /* default bytes kept in the store */
+#define CACHEFILES 64         /* input file digests remembered */
+#define CACHESTALE 86400      /* age in seconds of a leftover temporary file */
+#define CACHEBASIS (((unsigned __int128)0x6c62272e07bb0142 << 64) | 0x62b821756295c58d)
+
+/* Tokenizer manifest constants: the characters that end a run of
+ * plain bytes, outside quotes, inside '...' and inside "..." */
+#define TOKPLAIN  " \t\n'\"\\;&|$*?["
+#define TOKSQUOTE "'\\$*?["
+#define TOKDQUOTE "\"\\$*?["
+#define TOKMAXSET 16          /* most characters in one of the sets */
+
+/* Argument types recorded by parseline */
+#define ARGWORD   0 /* word with something to expand */
+#define ARGQUOTED 1 /* word with nothing to expand, taken as is */
+#define ARGOP     2 /* list operator: ;, && or || */
+#define ARGAMP    3 /* a lone & with no quotes or backslashes */
+#define ARGQWORD  4 /* word with something to expand and quotes in it */
+
+/* List connectors: when to run a step after the previous one */
+#define SEQ 0   /* ; always */
+#define AND 1   /* && if it succeeded */
+#define OR  2   /* || if it failed */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define WT 4    /* waiting for other jobs */
 
 /* 
- * Jobs states: FG (foreground), BG (background), ST (stopped)
+ * Jobs states: FG (foreground), BG (background), ST (stopped),
+ * WT (waiting)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
- * At most 1 job can be in the FG state.
+ *     WT -> BG  : the jobs it waits for all succeed
+ * At most 1 job can be in the FG state. A WT job has no processes
+ * (its pid is 0) until it starts, and neither has a command list in
+ * between two of its steps.
  */
 
 /* Global variables */
 extern char **environ;      /* defined in libc */
 char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
+int subreaper = 0;          /* if true, adopt and reap orphaned descendants */
 int nextjid = 1;            /* next job ID to allocate */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
+struct cmdlist_t {          /* A command list, run one step at a time */
+    char **argv;            /* words of all the steps, NULL after each */
+    int *argtype;           /* ARGWORD, ARGQWORD, ARGQUOTED or ARGAMP for each word */
+    int *first;             /* index in argv of each step's first word */
+    int *op;                /* SEQ, AND or OR before each step */
+    int nargs;              /* entries in argv, NULLs included */
+    int nsteps;             /* steps in the list */
+    int next;               /* next step to consider */
+    int status;             /* exit status of the last step run */
+};
+
 struct job_t {              /* The job struct */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (of the running step of a list) */
     int jid;                /* job ID [1, 2, ...] */
     int state;              /* UNDEF, BG, FG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    pid_t leader;           /* PID of the first step, naming the job to clients */
+    int status;             /* exit status once the process is reaped */
+    struct cmdlist_t *list; /* steps still to run, NULL if none */
+    unsigned int after;     /* bit i set while waiting for jobs[i] */
+    int reaped;             /* its running step is done, see advancejobs() */
+    char *cmdline;          /* command line, malloc'd */
+    struct timeval utime;   /* user time of the job's reaped processes */
+    struct timeval stime;   /* system time of the job's reaped processes */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+
+struct histidx_t {          /* Header of the history index file */
+    uint32_t magic;         /* HISTMAGIC */
+    uint32_t blocksize;     /* HISTBLOCK */
+    uint64_t logino;        /* inode of the indexed log */
+    uint64_t covered;       /* log bytes covered by the index */
+    uint64_t nentries;      /* log entries in those bytes */
+    uint64_t nuniq;         /* distinct commands among them */
+};                          /* followed by offsets and block maxima */
+
+struct hist_t {             /* The shell's view of the history */
+    int fd;                 /* append-only log, -1 if disabled */
+    char *idxpath;          /* index file name */
+    char *log;              /* mapped log */
+    size_t loglen;          /* bytes of log mapped */
+    struct histidx_t *idx;  /* mapped index */
+    size_t idxlen;          /* bytes of index mapped */
+    ino_t idxino;           /* inode of the mapped index */
+    uint64_t *off;          /* distinct entries sorted by text */
+    uint64_t *blockmax;     /* newest offset in each HISTBLOCK of off */
+    uint64_t nentries;      /* log entries covered by the index */
+    uint64_t nuniq;         /* entries in off */
+    uint64_t *tail;         /* offsets of entries after the index */
+    size_t ntail;           /* entries in tail */
+    size_t tailcap;         /* allocated size of tail */
+    uint64_t scanned;       /* log bytes parsed so far */
+};
+struct hist_t hist = { -1 }; /* The history */
+
+size_t linemax;             /* longest command line: ARG_MAX */
+
+struct token_t {            /* Reusable buffers for the words of a line */
+    char *buf;              /* the words, each NUL-terminated */
+    size_t cap;             /* allocated size of buf */
+    char **argv;            /* the words, then NULL */
+    int *argtype;           /* ARGWORD, ARGQWORD, ARGQUOTED, ARGOP or ARGAMP for argv[i] */
+    int *first;             /* for parselist: where each step starts */
+    int *op;                /* for parselist: each step's connector */
+    size_t argcap;          /* allocated size of argv, argtype, first, op */
+};
+struct token_t tok;         /* The words of the command line */
+int laststatus = 0;         /* exit status of the last foreground job */
+
+struct expand_t {           /* Reusable buffers for expanded words */
+    char *buf;              /* the words, each NUL-terminated */
+    size_t len;             /* bytes used in buf */
+    size_t cap;             /* allocated size of buf */
+    size_t *off;            /* offset in buf of each word */
+    char **argv;            /* the words, once buf has settled */
+    size_t argc;            /* number of words */
+    size_t argcap;          /* allocated size of off and argv */
+    size_t nassign;         /* leading NAME=value words */
+};
+struct expand_t xpand;      /* The expanded command line */
+#define XINPLACE ((size_t)-1) /* off of a word used where it is */
+
+struct var_t {              /* A shell variable */
+    struct var_t *next;     /* next in its hash chain */
+    char *entry;            /* "NAME=value" */
+    size_t namelen;         /* length of NAME */
+    int exported;           /* passed to jobs in envp? */
+    size_t envidx;          /* slot in envp, while envp is current */
+};
+struct var_t *vars[VARBUCKETS]; /* The variables */
+char **envp;                /* environment for jobs */
+size_t envc;                /* variables in envp */
+size_t envcap;              /* allocated size of envp */
+int envdirty = 1;           /* envp must be rebuilt */
+
+struct dircache_t {         /* A cached directory listing */
+    char *path;             /* directory, NULL if the slot is free */
+    dev_t dev;              /* device of the directory */
+    ino_t ino;              /* inode of the directory */
+    struct timespec mtime;  /* mtime of the directory when read */
+    int racy;               /* read too soon after a change to reuse */
+    char *names;            /* the names, each NUL-terminated */
+    size_t len;             /* bytes used in names */
+    size_t cap;             /* allocated size of names */
+    size_t *off;            /* offset of each name, sorted by name */
+    size_t n;               /* number of names */
+    size_t ncap;            /* allocated size of off */
+};
+struct dircache_t dircache[DIRCACHE]; /* Listings, hashed by directory */
+const char *dirsortbase;    /* names being sorted by dirsort() */
+
+struct client_t {           /* A client of the job daemon */
+    int fd;                 /* connection, -1 if the slot is free */
+    char *buf;              /* received bytes not served yet */
+    size_t len;             /* bytes in buf */
+    size_t cap;             /* allocated size of buf */
+    pid_t wait;             /* job being waited for, 0 if none */
+    int pollidx;            /* entry in the current ppoll() set */
+};
+
+struct done_t {             /* A finished job, for status and wait */
+    pid_t leader;           /* PID of its first step, 0 if it never ran */
+    int jid;                /* its job ID */
+    int status;             /* its exit status */
+};
+
+struct jobd_t {             /* The job daemon */
+    int fd;                 /* listening socket, -1 if not a daemon */
+    char *path;             /* socket file */
+    pid_t pid;              /* the daemon itself, not its jobs */
+    struct client_t client[MAXCLIENTS];
+    struct done_t done[DONELOG]; /* recently finished jobs, a ring */
+    unsigned long ndone;    /* jobs finished so far */
+};
+struct jobd_t jobd = { -1 }; /* The daemon */
+
+struct cachehdr_t {         /* Header of a cache entry file */
+    uint32_t magic;         /* CACHEMAGIC */
+    int32_t status;         /* exit status of the command */
+    uint64_t outlen;        /* bytes of stdout, which follow */
+    uint64_t errlen;        /* bytes of stderr, after those */
+};
+
+struct cacherun_t {         /* A cached command being recorded */
+    pid_t pid;              /* its tee process, 0 if the slot is free */
+    char *path;             /* entry to create */
+    char *tmp;              /* temporary file holding its stdout */
+    int outfd;              /* tmp, written after room for the header */
+    int errfd;              /* unnamed temporary file holding its stderr */
+    int reaped;             /* the tee is gone, see cachedone() */
+    int status;             /* its wait status, once reaped */
+};
+
+struct cachefile_t {        /* A remembered input file digest */
+    char *path;             /* file, NULL if the slot is free */
+    dev_t dev;              /* device of the file */
+    ino_t ino;              /* inode of the file */
+    off_t size;             /* size of the file when read */
+    struct timespec mtime;  /* mtime of the file when read */
+    int racy;               /* read too soon after a change to reuse */
+    unsigned __int128 digest; /* hash of its content */
+};
+
+struct cache_t {            /* The result cache */
+    char *dir;              /* store in use */
+    long long total;        /* bytes in it, -1 if not sized up yet */
+    struct cacherun_t run[MAXJOBS]; /* misses being recorded */
+    struct cacherun_t *next; /* set up for the next fork */
+    unsigned long seq;      /* numbers temporary files */
+    struct cachefile_t file[CACHEFILES]; /* digests, hashed by path */
+};
+struct cache_t cache;       /* The cache */
 /* End global variables */
 
 
@@ -57,7 +290,11 @@ struct job_t jobs[MAXJOBS]; /* The job list */
 /* Here are the functions that you will implement */
 void eval(char *cmdline);
 int builtin_cmd(char **argv);
+int isbuiltin(const char *name);
 void do_bgfg(char **argv);
+void do_history(char **argv);
+void do_export(char **argv);
+void do_unset(char **argv);
 void waitfg(pid_t pid);
 
 void sigchld_handler(int sig);
@@ -65,7 +302,18 @@ void sigtstp_handler(int sig);
 void sigint_handler(int sig);
 
 /* Here are helper routines that we've provided for you */
-int parseline(const char *cmdline, char **argv); 
+size_t readcmd(char **buf, size_t *cap);
+int parseline(const char *cmdline, char ***argvp); 
+size_t tokspan(const char *s, size_t len, int quote);
+void tokgrow(size_t len);
+void tokroom(size_t argc);
+int oplength(const char *s);
+int parselist(struct cmdlist_t *list, char **argv, int *argtype, int *first, int *op);
+struct cmdlist_t *copylist(struct cmdlist_t *list);
+pid_t startjob(struct cmdlist_t *list, int state, char *cmdline);
+void afterjob(struct cmdlist_t *list, char *cmdline);
+pid_t runlist(struct cmdlist_t *list);
+pid_t runstep(char **argv, int *argtype, int *status);
 void sigquit_handler(int sig);
 
 void clearjob(struct job_t *job);
@@ -76,12 +324,95 @@ int deletejob(struct job_t *jobs, pid_t pid);
 pid_t fgpid(struct job_t *jobs);
 struct job_t *getjobpid(struct job_t *jobs, pid_t pid);
 struct job_t *getjobjid(struct job_t *jobs, int jid); 
+struct job_t *getjobleader(struct job_t *jobs, pid_t pid);
 int pid2jid(pid_t pid); 
 void listjobs(struct job_t *jobs);
+int jobdone(struct job_t *job);
+void finishjob(struct job_t *job);
+void stepdone(struct job_t *job);
+void afterstart(struct job_t *job);
+void afterdone(int slot, int jid, int status);
+void advancejobs(void);
+
+int histcmp(const char *a, const char *b);
+int histcmpn(const char *entry, const char *prefix, size_t plen);
+int histsort(const void *a, const void *b);
+void histmap(void);
+void histloadidx(void);
+void histscan(void);
+void histrebuild(void);
+void histsync(void);
+void histinit(char *path);
+void histadd(char *cmdline);
+char *histfind(const char *prefix, size_t plen);
+void histlist(unsigned long n, const char *pattern);
+int histexpand(char **cmdline, size_t *cap);
+
+void xgrow(size_t n);
+void xputs(const char *s, size_t n);
+void xendword(size_t start);
+void xaddword(char *word);
+size_t xunescape(char *s, size_t n);
+struct dircache_t *dirlist(const char *dir);
+int dirsort(const void *a, const void *b);
+size_t dirfirst(struct dircache_t *dc, const char *prefix, size_t plen);
+int hasglob(const char *s);
+int globpath(char *path, size_t plen, const char *pat);
+char *lookupvar(const char *name, size_t len);
+char **expandargs(char **argv, int *argtype);
+
+unsigned int varhash(const char *name, size_t len);
+struct var_t *findvar(const char *name, size_t len);
+size_t varname(const char *word);
+size_t isassign(const char *word);
+void setvar(const char *entry, size_t namelen, int export);
+void unsetvar(const char *name, size_t len);
+void initvars(void);
+char **envsync(size_t spare);
+void envoverride(char **assign, size_t n);
+int envsort(const void *a, const void *b);
+
+unsigned __int128 cachehash(unsigned __int128 h, const void *data, size_t len);
+int cachefile(const char *path, unsigned __int128 *digest);
+unsigned __int128 cachestat(unsigned __int128 h, const struct stat *st);
+char *cachedir(void);
+long long cachemax(void);
+int cachecopy(int from, off_t off, uint64_t len, int to);
+size_t cachebegin(char **argv, size_t nassign, int *status);
+void cachetee(struct cacherun_t *r);
+int cachetwait(pid_t pid, int *status, int flags);
+void cachetchld(int sig);
+int cachewrite(int fd, const char *buf, size_t len);
+void cacheforked(pid_t pid);
+void cachereaped(pid_t pid, int status);
+void cachedone(void);
+void cachedrop(struct cacherun_t *r);
+void cacheevict(long long max);
+int cachesort(const void *a, const void *b);
+
+void jobdinit(char *path);
+void jobdexit(void);
+void jobdserve(void);
+void jobdaccept(void);
+void jobdclose(struct client_t *c);
+int jobdreply(int fd, const char *buf, size_t len);
+void jobdread(struct client_t *c);
+void jobdrun(struct client_t *c);
+void jobdrequest(struct client_t *c, char *req);
+int jobdsubmit(char *cmd, char *reply);
+int jobdbuiltin(struct cmdlist_t *list);
+struct job_t *jobdfind(const char *spec);
+const char *jobdstate(struct job_t *job);
+void jobdrecord(struct job_t *job);
+struct done_t *jobdstatus(pid_t pid, int jid);
+void jobdwake(void);
 
 void usage(void);
 void unix_error(char *msg);
 void app_error(char *msg);
+pid_t reapchild(int *status, pid_t *pgid, struct rusage *ru);
+unsigned int fnvhash(const char *s, size_t len);
+int racy(const struct stat *st);
 pid_t Fork(void);
 int Sigprocmask(int action, sigset_t* set, void*);
 int Sigaddset(sigset_t *set, int signal);
@@ -97,15 +428,18 @@ handler_t *Signal(int signum, handler_t *handler);
 int main(int argc, char **argv) 
 {
     char c;
-    char cmdline[MAXLINE];
+    char *cmdline = NULL;  /* the line read, grown as needed */
+    size_t cap = 0, len;
+    char *sockpath = NULL; /* serve job requests here (-d) */
     int emit_prompt = 1; /* emit prompt (default) */
+    sigset_t chld;       /* just SIGCHLD */
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(1, 2);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != EOF) {
+    while ((c = getopt(argc, argv, "hvprH:d:")) != EOF) {
         switch (c) {
         case 'h':             /* print help message */
             usage();
@@ -116,11 +450,24 @@ int main(int argc, char **argv)
         case 'p':             /* don't print a prompt */
             emit_prompt = 0;  /* handy for automatic testing */
 	    break;
+        case 'r':             /* reap orphaned descendants of our jobs */
+            subreaper = 1;
+	    break;
+        case 'H':             /* keep a persistent history */
+            histinit(optarg);
+	    break;
+        case 'd':             /* run as a job daemon */
+            sockpath = optarg;
+	    break;
 	default:
             usage();
 	}
     }
 
+    /* Orphaned grandchildren are reparented to us instead of init */
+    if (subreaper && prctl(PR_SET_CHILD_SUBREAPER, 1) < 0)
+        unix_error("prctl error");
+
     /* Install the signal handlers */
 
     /* These are the ones you will need to implement */
@@ -131,8 +478,24 @@ int main(int argc, char **argv)
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
 
-    /* Initialize the job list */
+    /* Initialize the job list and the variables */
     initjobs(jobs);
+    initvars();
+    if ((long)(linemax = sysconf(_SC_ARG_MAX)) <= 0)
+	linemax = 1 << 17;
+
+    /* Jobs are only reaped while the shell is idle: waiting for input
+     * here, or for a job in waitfg(). Command lists are advanced right
+     * after that, by advancejobs() */
+    Sigemptyset(&chld);
+    Sigaddset(&chld, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &chld, NULL);
+
+    /* A daemon takes its commands from the socket instead */
+    if (sockpath) {
+	jobdinit(sockpath);
+	jobdserve();
+    }
 
     /* Execute the shell's read/eval loop */
     while (1) {
@@ -142,12 +505,20 @@ int main(int argc, char **argv)
 	    printf("%s", prompt);
 	    fflush(stdout);
 	}
-	if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-	    app_error("fgets error");
-	if (feof(stdin)) { /* End of file (ctrl-d) */
+	len = readcmd(&cmdline, &cap);
+	if (len == 0) { /* End of file (ctrl-d) */
 	    fflush(stdout);
 	    exit(0);
 	}
+	if (len > linemax) {
+	    printf("line too long\n");
+	    continue;
+	}
+
+	/* Recall !prefix from the history, then record the command */
+	if (!histexpand(&cmdline, &cap))
+	    continue;
+	histadd(cmdline);
 
 	/* Evaluate the command line */
 	eval(cmdline);
@@ -168,106 +539,609 @@ int main(int argc, char **argv)
  * each child process must have a unique process group ID so that our
  * background children don't receive SIGINT (SIGTSTP) from the kernel
  * when we type ctrl-c (ctrl-z) at the keyboard.  
+ *
+ * A line may hold a list of commands joined by ;, && and ||. The steps
+ * run one after another as a single job: the first forked step starts
+ * the job here, and advancejobs() starts each later step once
+ * sigchld_handler has reaped the one before it.
+ *
+ * "after %1 %3 -- cmd" makes a job that waits until jobs %1 and %3
+ * have succeeded, and is then started by advancejobs() as well.
 */
 void eval(char *cmdline) 
 {
-    char *argv[MAXARGS];                                                        //arguments for execve()
+    char **argv;                                                                //arguments from parseline()
+    struct cmdlist_t list;                                                      //the steps of the line
     int bg;                                                                     //Determines whether the job will run in foreground or background
     pid_t pid;                                                                  //Contains the process id
     struct job_t *jd;
-    sigset_t mask;                                                              //The signal set which has to be bloacked before adding the job to jobs
 
-    bg = parseline(cmdline, argv);                                              //Copies contents of cmdline into argv and returns whether the job should run in background or foreground
+    bg = parseline(cmdline, &argv);                                             //Splits cmdline into argv and returns whether the job should run in background or foreground
+    if(argv[0] == NULL || !parselist(&list, argv, tok.argtype, tok.first, tok.op)){ //Ignore blank lines and bad lists
+        return;
+    }
+
+    if(!(pid = startjob(&list, bg ? BG : FG, cmdline))){                        //Only builtins: no job
+        return;
+    }
+
+    if(bg){                                                                     //If process is a background
+        if((jd = getjobpid(jobs, pid))){                                        //Unless the job table was full
+            printf("[%d] (%d) %s", jd->jid, jd->pid, jd->cmdline);              //Print the details of background job
+        }
+        laststatus = 0;
+    }
+    else{                                                                       //If process is foreground, parent waits for the job to terminate
+        waitfg(pid);
+    }
+    return;
+}
+
+/*
+ * startjob - Run a parsed command list as a new job in the given state.
+ *     Return the pid of its first forked step, or 0 if builtins and
+ *     assignments were all there was to run.
+ */
+pid_t startjob(struct cmdlist_t *list, int state, char *cmdline)
+{
+    pid_t pid;                                                                  //Contains the process id
+    struct job_t *jd;
+    sigset_t mask;                                                              //The signals runstep() leaves blocked until the job is added
 
     Sigemptyset(&mask);                                                         //Generate an empty signal set in mask
-    Sigaddset(&mask, SIGCHLD);                                                  //Add SIGCHLD to the signal set to be blocked
-    Sigaddset(&mask, SIGINT);                                                   //Add SIGINT to the signal set to be blocked
-    Sigaddset(&mask, SIGTSTP);                                                  //Add SIGTSTP to the signal set to be blocked
+    Sigaddset(&mask, SIGINT);                                                   //Add SIGINT to the signal set
+    Sigaddset(&mask, SIGTSTP);                                                  //Add SIGTSTP to the signal set
 
-    if(!builtin_cmd(argv)){                                                     //Checks whether command is built-in and executes it if yes, else enters if block
-        Sigprocmask(SIG_BLOCK, &mask, NULL);                                    //Blocked the signal set
-        if((pid = Fork()) == 0){                                                //Run user process in a child
-            Sigprocmask(SIG_UNBLOCK, &mask, NULL);                              //Unblock the signal sets in child
-            Setpgid(0,0);                                                       //New jobs should have new process ids else signal will kill shell also          
-            if(execve(argv[0], argv, environ) < 0){                             //executes user command if successful
-                printf("%s: Command not found.\n", argv[0]);                    //Throw error if execution unsuccessful
-                exit(0);
-            }
+    if(list->argtype[0] == ARGQUOTED && !strcmp(list->argv[0], "after")){       //A job for later
+        afterjob(list, cmdline);
+        return 0;
+    }
+
+    list->status = laststatus;                                                  //$? of the first step
+    if(!(pid = runlist(list))){                                                 //Run builtins until a step is forked
+        laststatus = list->status;
+        return 0;
+    }
+
+    addjob(jobs, pid, state, cmdline);                                          //Add the process to jobs
+    jd = getjobpid(jobs, pid);
+    if(jd && list->next < list->nsteps){                                        //If steps remain
+        jd->list = copylist(list);                                              //keep them, as argv won't last
+    }
+    Sigprocmask(SIG_UNBLOCK, &mask, NULL);                                      //Unblock the signal set afet adding the job
+    return pid;
+}
+
+/*
+ * afterjob - Add a job that waits for other jobs: "after <job> ... --
+ *     <command list>", each job named by %jid or pid. It is started by
+ *     afterdone() once they have all succeeded.
+ */
+void afterjob(struct cmdlist_t *list, char *cmdline)
+{
+    struct job_t *jd;                                                           //Store the job details
+    unsigned int after = 0;                                                     //The jobs waited for, by slot
+    char **argv = list->argv;
+    int i, jid;
+
+    laststatus = 1;                                                             //Unless the job is added
+    for(i = 1; argv[i] && strcmp(argv[i], "--"); i++){                          //Each job to wait for
+        jd = NULL;
+        if(argv[i][0] == '%' && isdigit(argv[i][1])){                           //If % then job id
+            jd = getjobjid(jobs, atoi(&argv[i][1]));
+        }
+        else if(isdigit(argv[i][0])){                                           //else pid
+            jd = getjobpid(jobs, atoi(argv[i]));
+        }
+        if(!jd){
+            printf("after: %s: no such job\n", argv[i]);                        //throw error
+            return;
+        }
+        after |= 1u << (jd - jobs);
+    }
+    if(!after || !argv[i] || !argv[i + 1]){                                     //If no jobs or no command
+        printf("after: usage: after <job> ... -- <command>\n");                 //throw error
+        return;
+    }
+
+    list->first[0] = i + 1;                                                     //The list starts after --
+    list->next = 0;
+    jid = nextjid;                                                              //as addjob() will number it
+    if(!addjob(jobs, 0, WT, cmdline) || !(jd = getjobjid(jobs, jid))){          //If the job table is full
+        return;
+    }
+    jd->list = copylist(list);
+    jd->after = after;
+    printf("[%d] (%d) %s", jd->jid, jd->pid, jd->cmdline);                      //Print the details of the waiting job
+    laststatus = 0;
+}
+
+/*
+ * runlist - Run the steps of a command list from list->next on, skipping
+ *     those whose connector says so, until a step is forked. Builtins and
+ *     assignments run on the spot. Return the pid of the forked step,
+ *     with SIGINT and SIGTSTP left blocked, or 0 once the list is done.
+ */
+pid_t runlist(struct cmdlist_t *list)
+{
+    pid_t pid;
+    int i;
+
+    while(list->next < list->nsteps){
+        i = list->next++;
+        if((list->op[i] == AND && list->status) ||                              //&& after a failure
+           (list->op[i] == OR && !list->status)){                               //or || after a success
+            continue;                                                           //skips the step, keeping the status
+        }
+        if((pid = runstep(list->argv + list->first[i], list->argtype + list->first[i], &list->status))){
+            return pid;
         }
+    }
+    return 0;
+}
+
+/*
+ * runstep - Expand and run a single command. Builtins and assignments
+ *     run in the shell and set *status to 0. Anything else is forked,
+ *     and the child's pid is returned with SIGINT and SIGTSTP blocked
+ *     so that the caller can record it first.
+ */
+pid_t runstep(char **argv, int *argtype, int *status)
+{
+    char **xargv;                                                               //expanded arguments for execve()
+    size_t nassign, i;                                                          //leading NAME=value words in xargv
+    size_t cmd;                                                                 //index in xargv of the command
+    int oldstatus = laststatus;
+    sigset_t mask, empty;
+    pid_t pid;
+
+    laststatus = *status;                                                       //$? is the previous step's status
+    xargv = expandargs(argv, argtype);                                          //Substitute $variables and glob patterns
+    laststatus = oldstatus;
+    nassign = xpand.nassign;
+    *status = 0;
 
-        if(!bg){                                                                //If process is foreground, parent waits for the job to terminate
-            addjob(jobs, pid, FG, cmdline);                                     //Add the process to jobs
-            Sigprocmask(SIG_UNBLOCK, &mask, NULL);                              //Unblock the signal set afet adding the job
-            waitfg(pid);                                                        //Parent waits for the foreground process to terminate}
+    if(xargv[nassign] == NULL){                                                 //Only NAME=value words, or nothing left
+        for(i = 0; i < nassign; i++){
+            setvar(xargv[i], isassign(xargv[i]), 0);                            //set them as shell variables
         }
+        return 0;
+    }
+    cmd = nassign;
+    if(!strcmp(xargv[cmd], "cached") && !(cmd = cachebegin(xargv, nassign, status))){ //Replay a stored result, if any
+        return 0;
+    }
+    if(jobd.fd >= 0 && isbuiltin(xargv[cmd])){                                  //However it was spelled, a daemon
+        printf("%s: not run by the job daemon\n", xargv[cmd]);                  //refuses it
+        *status = 1;
+        cacheforked(0);
+        return 0;
+    }
+    if(builtin_cmd(xargv + cmd)){                                               //Checks whether command is built-in and executes it
+        cacheforked(0);                                                         //not worth recording
+        return 0;
+    }
 
-        else{                                                                   //If process is a background
-            addjob(jobs, pid, BG, cmdline);                                     //Add the process to jobs
-            Sigprocmask(SIG_UNBLOCK, &mask, NULL);                              //Unblock the signal set afet adding the job
-            jd = getjobpid(jobs, pid);                                          //Get the jobpid
-            printf("[%d] (%d) %s", jd->jid, jd->pid, jd->cmdline);              //Print the details of background job
+    Sigemptyset(&mask);                                                         //Generate an empty signal set in mask
+    Sigaddset(&mask, SIGINT);                                                   //Add SIGINT to the signal set to be blocked
+    Sigaddset(&mask, SIGTSTP);                                                  //Add SIGTSTP to the signal set to be blocked
+    Sigemptyset(&empty);
+
+    envsync(nassign);                                                           //Current environment, with room for overrides
+    Sigprocmask(SIG_BLOCK, &mask, NULL);                                        //Blocked the signal set
+    fflush(stdout);                                                             //So the child has no copy to flush
+    if((pid = Fork()) == 0){                                                    //Run user process in a child
+        Sigprocmask(SIG_SETMASK, &empty, NULL);                                 //Unblock everything in child
+        Setpgid(0,0);                                                           //New jobs should have new process ids else signal will kill shell also          
+        envoverride(xargv, nassign);                                            //Apply VAR=val overrides in our copy of envp
+        if(cache.next){                                                         //Output to be recorded for the cache
+            cachetee(cache.next);                                               //goes through a tee, which stays here
+        }
+        if(execve(xargv[cmd], xargv + cmd, envp) < 0){                          //executes user command if successful
+            printf("%s: Command not found.\n", xargv[cmd]);                     //Throw error if execution unsuccessful
+            fflush(stdout);
+            _exit(127);                                                         //which a following || can test; not exit(), whose handlers are the shell's
         }
     }
-    return;
+    cacheforked(pid);                                                           //The cache now waits for pid
+    return pid;
+}
+
+/*
+ * readcmd - Read a command line of any length into *buf, growing it as
+ *     needed. Input is read INBUF bytes at a time into a buffer of our
+ *     own, so that the shell can wait for it in ppoll() with SIGCHLD let
+ *     in, and move on the jobs that were reaped before reading on. The
+ *     bytes of a line longer than linemax are read but not kept. Return
+ *     the length of the line, 0 at end of file.
+ */
+size_t readcmd(char **buf, size_t *cap)
+{
+    static char in[INBUF];  /* input read but not returned yet */
+    static size_t inpos, inlen;
+    static int ineof;
+    struct pollfd pfd;
+    sigset_t chld, wait;
+    size_t len = 0, keep, n;
+    ssize_t got;
+    char *nl;
+
+    Sigemptyset(&chld);
+    Sigaddset(&chld, SIGCHLD);
+    Sigprocmask(SIG_UNBLOCK, &chld, &wait); /* reap what is pending, */
+    Sigprocmask(SIG_BLOCK, &chld, NULL);    /* even if input is at hand */
+    sigdelset(&wait, SIGCHLD);              /* ppoll() lets it in later */
+    advancejobs();
+
+    while (1) {
+	if (inpos == inlen) {
+	    if (ineof)
+		break;
+	    pfd.fd = STDIN_FILENO;
+	    pfd.events = POLLIN;
+	    if (ppoll(&pfd, 1, NULL, &wait) < 0) { /* reap only in here */
+		if (errno != EINTR)
+		    unix_error("ppoll error");
+		advancejobs();
+		continue;
+	    }
+	    if ((got = read(STDIN_FILENO, in, INBUF)) < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+		    continue;
+		unix_error("read error");
+	    }
+	    inpos = 0;
+	    inlen = got;
+	    ineof = got == 0;
+	    continue;
+	}
+
+	/* Take the input up to the end of the line, keeping what fits */
+	nl = memchr(in + inpos, '\n', inlen - inpos);
+	n = nl ? (size_t)(nl - (in + inpos)) + 1 : inlen - inpos;
+	keep = len > linemax ? 0 : (n < linemax + 1 - len ? n : linemax + 1 - len);
+	while (*cap < len + keep + 1) {
+	    *cap = *cap ? 2 * *cap : MAXLINE;
+	    if (!(*buf = realloc(*buf, *cap)))
+		app_error("readcmd: out of memory");
+	}
+	memcpy(*buf + (len > linemax ? linemax + 1 : len), in + inpos, keep);
+	len += n;
+	inpos += n;
+	if (nl)
+	    break;
+    }
+    if (*cap == 0 && !(*buf = malloc(*cap = MAXLINE)))
+	app_error("readcmd: out of memory");
+    (*buf)[len > linemax ? linemax + 1 : len] = '\0';
+    return len;
 }
 
 /* 
  * parseline - Parse the command line and build the argv array.
  * 
- * Characters enclosed in single quotes are treated as a single
- * argument.  Return true if the user has requested a BG job, false if
- * the user has requested a FG job.  
+ * Words are separated by blanks. Characters enclosed in single quotes
+ * are taken literally. In double quotes only $ keeps its meaning, and
+ * a backslash quotes $, ", \ or a newline. Outside quotes a backslash
+ * quotes the next character if it is special to the shell, and stands
+ * for itself otherwise. The list operators ;, && and || are arguments
+ * of their own even when not set off by blanks.
+ *
+ * The words are written once into tok.buf, which grows with the line,
+ * and *argvp is set to tok.argv, which points into it. Quoted $, *, ?,
+ * [ and \ are kept behind a backslash for expandargs(), and
+ * tok.argtype[] records which words have anything to expand at all,
+ * and which of those had quotes. Only a last word that is a bare &
+ * with no quotes or backslashes in it asks for a background job.
+ * Return true if the user has requested a BG job, false if the user
+ * has requested a FG job.  
  */
-int parseline(const char *cmdline, char **argv) 
+int parseline(const char *cmdline, char ***argvp) 
 {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
-    char *delim;                /* points to first space delimiter */
-    int argc;                   /* number of args */
+    const char *p = cmdline;    /* traverses command line */
+    const char *end;            /* end of command line */
+    char *out;                  /* where the next byte of a word goes */
+    size_t len;                 /* length of command line */
+    size_t argc;                /* number of args */
+    size_t n;                   /* length of a run of plain bytes */
     int bg;                     /* background job? */
+    int oplen;                  /* length of an operator */
+    int quote;                  /* ' or " while inside quotes */
+    int quoted;                 /* were there quotes in the word? */
+    int bare;                   /* no quotes or backslashes in the word? */
+    int literal;                /* nothing to expand in the word? */
+    int esc;                    /* is c quoted? */
+    int c;
 
-    strcpy(buf, cmdline);
-    buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
-    while (*buf && (*buf == ' ')) /* ignore leading spaces */
-	buf++;
+    tokroom(0);
+    *argvp = tok.argv;
+    tok.argv[0] = NULL;
+    if ((len = strlen(cmdline)) > linemax) {
+	printf("line too long\n");
+	return 1;
+    }
+    end = cmdline + len;
+    tokgrow(2 * len + 2); /* a word byte takes at most two */
+    out = tok.buf;
 
     /* Build the argv list */
     argc = 0;
-    if (*buf == '\'') {
-	buf++;
-	delim = strchr(buf, '\'');
-    }
-    else {
-	delim = strchr(buf, ' ');
-    }
+    while (1) {
+	while (p < end && (*p == ' ' || *p == '\t' || *p == '\n')) /* ignore blanks */
+	    p++;
+	if (p == end)
+	    break;
+	tokroom(argc + 1);
+
+	if ((oplen = oplength(p))) {
+	    tok.argtype[argc] = ARGOP;
+	    tok.argv[argc++] = oplen == 1 ? ";" : (*p == '&' ? "&&" : "||");
+	    p += oplen;
+	    continue;
+	}
+
+	/* A word runs up to an unquoted blank or operator */
+	tok.argv[argc] = out;
+	quote = quoted = 0;
+	literal = bare = 1;
+	while (1) {
+	    n = tokspan(p, end - p, quote); /* copy plain bytes in bulk */
+	    memcpy(out, p, n);
+	    out += n;
+	    p += n;
+	    if (p == end)
+		break;
+	    if (!quote && (*p == ' ' || *p == '\t' || *p == '\n' || oplength(p)))
+		break;
+
+	    c = *p++;
+	    if (c == quote) { /* closing quote */
+		quote = 0;
+		continue;
+	    }
+	    if (!quote && (c == '\'' || c == '"')) { /* opening quote */
+		quote = quoted = c;
+		bare = 0;
+		continue;
+	    }
 
-    while (delim) {
-	argv[argc++] = buf;
-	*delim = '\0';
-	buf = delim + 1;
-	while (*buf && (*buf == ' ')) /* ignore spaces */
-	       buf++;
+	    if (quote == '\'') /* $ * ? [ \ in '...' */
+		esc = 1;
+	    else if (c == '\\') {
+		esc = 1;
+		bare = 0;
+		if (p < end && strchr(quote ? "$\"\\\n" : TOKPLAIN, *p)) {
+		    if ((c = *p++) == '\n') /* line continuation */
+			continue;
+		}
+	    }
+	    else /* * ? [ in "...", and the unquoted ones */
+		esc = quote && c != '$';
 
-	if (*buf == '\'') {
-	    buf++;
-	    delim = strchr(buf, '\'');
+	    if (esc && strchr("$*?[\\", c)) { /* quoted for expandargs() */
+		*out++ = '\\';
+		literal = 0;
+	    }
+	    else if (!esc && c != '&' && c != '|') /* to be expanded */
+		literal = 0;
+	    *out++ = c;
 	}
-	else {
-	    delim = strchr(buf, ' ');
+
+	if (quote) {
+	    printf("syntax error: unterminated %c\n", quote);
+	    tok.argv[0] = NULL;
+	    *argvp = tok.argv;
+	    return 1;
 	}
+	if (out == tok.argv[argc] && !quoted) /* only line continuations */
+	    continue;
+	*out++ = '\0';
+	if (bare && !strcmp(tok.argv[argc], "&"))
+	    tok.argtype[argc] = ARGAMP;
+	else
+	    tok.argtype[argc] = literal ? ARGQUOTED : (quoted ? ARGQWORD : ARGWORD);
+	argc++;
     }
-    argv[argc] = NULL;
+    tok.argv[argc] = NULL;
+    *argvp = tok.argv; /* now that it has settled */
     
     if (argc == 0)  /* ignore blank line */
 	return 1;
 
     /* should the job run in the background? */
-    if ((bg = (*argv[argc-1] == '&')) != 0) {
-	argv[--argc] = NULL;
+    if ((bg = (tok.argtype[argc-1] == ARGAMP)) != 0) {
+	tok.argv[--argc] = NULL;
     }
     return bg;
 }
 
+/*
+ * tokspan - Return how many bytes at the start of s[0..len) may be
+ *     copied as they are: those not in the set of characters that
+ *     matter outside quotes (quote 0), or inside '...' or "...".
+ *     With SSE2, once the run is longer than a short word, 16 bytes at
+ *     a time are checked: members below '0' with one unsigned compare
+ *     against the highest of them, the rest one by one. The first hit
+ *     that really is in the set ends the run.
+ */
+size_t tokspan(const char *s, size_t len, int quote)
+{
+    static const char *set[3] = { TOKPLAIN, TOKSQUOTE, TOKDQUOTE };
+    static unsigned char special[256]; /* bit k: in set[k] */
+    static int ready;
+    size_t i = 0;
+    int k, j;
+#ifdef __SSE2__
+    static __m128i splat[3][TOKMAXSET];
+    static __m128i low[3];      /* highest member below '0' */
+    static int nsplat[3];
+    __m128i v, m;
+    int mask;
+    char top;
+#endif
+
+    if (!ready) {
+	for (k = 0; k < 3; k++) {
+#ifdef __SSE2__
+	    top = 0;
+#endif
+	    for (j = 0; set[k][j]; j++) {
+		special[(unsigned char)set[k][j]] |= 1 << k;
+#ifdef __SSE2__
+		if (set[k][j] < '0')
+		    top = set[k][j] > top ? set[k][j] : top;
+		else
+		    splat[k][nsplat[k]++] = _mm_set1_epi8(set[k][j]);
+#endif
+	    }
+#ifdef __SSE2__
+	    low[k] = _mm_set1_epi8(top);
+#endif
+	}
+	ready = 1;
+    }
+    k = quote == '\'' ? 1 : (quote ? 2 : 0);
+
+#ifdef __SSE2__
+    for (; i < 16 && i < len; i++) /* most words end before a vector */
+	if (special[(unsigned char)s[i]] & (1 << k))
+	    return i;
+    for (; i + 16 <= len; i += 16) {
+	v = _mm_loadu_si128((const __m128i *)(s + i));
+	m = _mm_cmpeq_epi8(_mm_min_epu8(v, low[k]), v); /* v <= top */
+	for (j = 0; j < nsplat[k]; j++)
+	    m = _mm_or_si128(m, _mm_cmpeq_epi8(v, splat[k][j]));
+	for (mask = _mm_movemask_epi8(m); mask; mask &= mask - 1)
+	    if (special[(unsigned char)s[i + __builtin_ctz(mask)]] & (1 << k))
+		return i + __builtin_ctz(mask);
+    }
+#endif
+    while (i < len && !(special[(unsigned char)s[i]] & (1 << k)))
+	i++;
+    return i;
+}
+
+/*
+ * tokgrow - Make room for len bytes of words in tok.buf
+ */
+void tokgrow(size_t len)
+{
+    if (len <= tok.cap)
+	return;
+    free(tok.buf); /* nothing in it is kept */
+    tok.cap = len > 2 * tok.cap ? len : 2 * tok.cap;
+    if (!(tok.buf = malloc(tok.cap)))
+	app_error("parseline: out of memory");
+}
+
+/*
+ * tokroom - Make room for argument argc and the NULL after it
+ */
+void tokroom(size_t argc)
+{
+    if (argc + 1 < tok.argcap)
+	return;
+    tok.argcap = tok.argcap ? 2 * tok.argcap : MAXARGS;
+    if (!(tok.argv = realloc(tok.argv, tok.argcap * sizeof(char *))) ||
+	!(tok.argtype = realloc(tok.argtype, tok.argcap * sizeof(int))) ||
+	!(tok.first = realloc(tok.first, tok.argcap * sizeof(int))) ||
+	!(tok.op = realloc(tok.op, tok.argcap * sizeof(int))))
+	app_error("parseline: out of memory");
+}
+
+/* oplength - Return the length of the list operator s starts with, or 0 */
+int oplength(const char *s)
+{
+    if (*s == ';')
+	return 1;
+    if ((s[0] == '&' && s[1] == '&') || (s[0] == '|' && s[1] == '|'))
+	return 2;
+    return 0;
+}
+
+/*
+ * parselist - Split the arguments from parseline into the steps of a
+ *     command list, ending each step's arguments with a NULL. first and
+ *     op need room for one entry per argument. Return false, after
+ *     reporting it, if the list is malformed.
+ */
+int parselist(struct cmdlist_t *list, char **argv, int *argtype, int *first, int *op)
+{
+    int i, start = 0, n = 0, prevop = SEQ;
+
+    for(i = 0; ; i++){
+        if(argv[i] && argtype[i] != ARGOP){                                         //Part of the current step
+            continue;
+        }
+        if(i == start){                                                             //The step is empty
+            if(!argv[i] && n > 0 && prevop == SEQ){                                 //which is fine after a last ;
+                break;
+            }
+            printf("syntax error near `%s'\n", argv[i] ? argv[i] : "newline");   //throw error
+            return 0;
+        }
+        first[n] = start;                                                           //Record the step
+        op[n++] = prevop;
+        if(!argv[i]){                                                               //End of the line
+            break;
+        }
+        prevop = argv[i][0] == ';' ? SEQ : (argv[i][0] == '&' ? AND : OR);          //Connector of the next step
+        argv[i] = NULL;                                                             //ends this one's arguments
+        start = i + 1;
+    }
+
+    list->argv = argv;
+    list->argtype = argtype;
+    list->first = first;
+    list->op = op;
+    list->nargs = i + 1;
+    list->nsteps = n;
+    list->next = 0;
+    return 1;
+}
+
+/*
+ * copylist - Copy a command list, words and all, into a single block
+ *     that outlives the command line. free() releases it.
+ */
+struct cmdlist_t *copylist(struct cmdlist_t *list)
+{
+    struct cmdlist_t *copy;
+    size_t text = 0;
+    char *p;
+    int i;
+
+    for(i = 0; i < list->nargs; i++){                                               //Size up the words
+        if(list->argv[i]){
+            text += strlen(list->argv[i]) + 1;
+        }
+    }
+    if(!(copy = malloc(sizeof(*copy) + list->nargs * (sizeof(char *) + sizeof(int)) +
+                       2 * list->nsteps * sizeof(int) + text))){
+        app_error("list: out of memory");
+    }
+
+    *copy = *list;                                                                  //Lay out the arrays after it
+    copy->argv = (char **)(copy + 1);
+    copy->argtype = (int *)(copy->argv + list->nargs);
+    copy->first = copy->argtype + list->nargs;
+    copy->op = copy->first + list->nsteps;
+    p = (char *)(copy->op + list->nsteps);
+
+    memcpy(copy->argtype, list->argtype, list->nargs * sizeof(int));
+    memcpy(copy->first, list->first, list->nsteps * sizeof(int));
+    memcpy(copy->op, list->op, list->nsteps * sizeof(int));
+    for(i = 0; i < list->nargs; i++){                                               //then the words themselves
+        if(!list->argv[i]){
+            copy->argv[i] = NULL;
+            continue;
+        }
+        copy->argv[i] = p;
+        p = stpcpy(p, list->argv[i]) + 1;
+    }
+    return copy;
+}
+
 /* 
  * builtin_cmd - If the user has typed a built-in command then execute
  *    it immediately.  
@@ -279,7 +1153,12 @@ int builtin_cmd(char **argv)
     }
 
     if(!strcmp(argv[0], "jobs")){                                                   //If argument is jobs
+        sigset_t mask, prev;                                                        //Keep the reaper off the job list while printing it
+        Sigemptyset(&mask);
+        Sigaddset(&mask, SIGCHLD);
+        Sigprocmask(SIG_BLOCK, &mask, &prev);
         listjobs(jobs);                                                             //List all the jobs
+        Sigprocmask(SIG_SETMASK, &prev, NULL);                                      //SIGCHLD stays blocked outside idle points
         return 1;
     }
 
@@ -293,9 +1172,47 @@ int builtin_cmd(char **argv)
         return 1;
     }
 
+    if(!strcmp(argv[0], "history")){                                                //If argument is history
+        do_history(argv);                                                           //jump to do_history
+        return 1;
+    }
+
+    if(!strcmp(argv[0], "export")){                                                 //If argument is export
+        do_export(argv);                                                            //jump to do_export
+        return 1;
+    }
+
+    if(!strcmp(argv[0], "unset")){                                                  //If argument is unset
+        do_unset(argv);                                                             //jump to do_unset
+        return 1;
+    }
+
+    if(!strcmp(argv[0], "after")){                                                  //If after is not at the start
+        printf("after: must begin the command line\n");                            //throw error
+        return 1;
+    }
+
     return 0;                                                                       //not a builtin command
 }
 
+/*
+ * isbuiltin - Return true if builtin_cmd() would run name itself. The
+ *     job daemon doesn't run these: they work on the shell's terminal,
+ *     job control and variables, which clients don't share.
+ */
+int isbuiltin(const char *name)
+{
+    static const char *names[] = { "quit", "jobs", "bg", "fg", "history", "export", "unset", NULL };
+    int i;
+
+    for(i = 0; names[i]; i++){
+        if(!strcmp(name, names[i])){
+            return 1;
+        }
+    }
+    return 0;
+}
+
 /* 
  * do_bgfg - Execute the builtin bg and fg commands
  */
@@ -336,6 +1253,15 @@ void do_bgfg(char **argv)
         }
     }
 
+    if(jd->state == WT){                                                            //If it hasn't started
+        printf("%s: job %%%d is waiting for other jobs\n", argv[0], jd->jid);       //throw error
+        return;
+    }
+    if(!jd->pid){                                                                   //If it is the list running this builtin
+        printf("%s: no such job\n", argv[1]);                                       //jobs doesn't show it either
+        return;
+    }
+
     Kill(-jd->pid, SIGCONT);                                                        //Send SIGCONT signal
 
     if( !strcmp( argv[0],"bg" ) ){                                                  //If background
@@ -352,62 +1278,217 @@ void do_bgfg(char **argv)
 }
 
 /*
- * waitfg - Block until process pid is no longer the foreground process
+ * do_history - Execute the builtin history command
+ *     history          list the last HISTSHOW commands
+ *     history <n>      list the last n commands
+ *     history -s text  list every command containing text, which
+ *                      scans the whole log: only prefixes are indexed
  */
-void waitfg(pid_t pid)
+void do_history(char **argv)
 {
-    struct job_t *fg_job = getjobpid(jobs, pid);                                    //Get the foreground job
-    if(!fg_job){                                                                    //If no foreground job
-        return;                                                                     //return without doing anything
+    if(hist.fd < 0){                                                                //If the shell keeps no history
+        printf("history: no history file (use -H)\n");                             //throw error
+        return;
     }
 
-    while(fg_job->pid == pid && fg_job->state == FG){                               //If job is FG
-        sleep(1);                                                                   //then sleep
+    if(argv[1] == NULL){                                                            //If no second argument
+        histlist(HISTSHOW, NULL);                                                   //list the latest few
+    }
+    else if(!strcmp(argv[1], "-s") && argv[2] != NULL){                             //If searching
+        histlist(ULONG_MAX, argv[2]);                                               //list every match
+    }
+    else if(isdigit(argv[1][0])){                                                   //If a count
+        histlist(strtoul(argv[1], NULL, 10), NULL);                                 //list that many
+    }
+    else{
+        printf("history: usage: history [n | -s text]\n");                         //throw error
     }
     return;
 }
 
-/*****************
- * Signal handlers
- *****************/
-
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+/*
+ * do_export - Execute the builtin export command
+ *     export              list the exported variables
+ *     export NAME=value   set NAME and export it
+ *     export NAME         export NAME, if it is set
  */
-void sigchld_handler(int sig) 
+void do_export(char **argv)
 {
-    pid_t child_pid;                                                                //Stores the child pid
-    int status;                                                                     //Status variable
+    struct var_t *v;
+    char **list;
+    size_t len, i;
 
-    while((child_pid = waitpid(-1, &status, WNOHANG|WUNTRACED)) > 0){               //Get the child pid in the loop
-        struct job_t *jd = getjobpid(jobs, child_pid);                              //Get job detail of the child
-        if(!jd){                                                                    //If no job
-            printf("((%d): No such child", child_pid);                              //Throw error
-            return;
+    if(argv[1] == NULL){                                                            //If no second argument
+        envsync(0);                                                                 //list the environment
+        if(!(list = malloc((envc + 1) * sizeof(char *)))){
+            app_error("export: out of memory");
+        }
+        memcpy(list, envp, envc * sizeof(char *));
+        qsort(list, envc, sizeof(char *), envsort);                                 //sorted by name
+        for(i = 0; i < envc; i++){
+            printf("export %s\n", list[i]);
+        }
+        free(list);
+        return;
+    }
+
+    for(i = 1; argv[i]; i++){
+        len = varname(argv[i]);
+        if(!len || (argv[i][len] && argv[i][len] != '=')){                          //If not NAME or NAME=value
+            printf("export: `%s': not a valid identifier\n", argv[i]);              //throw error
+        }
+        else if(argv[i][len] == '='){                                               //If NAME=value
+            setvar(argv[i], len, 1);                                                //set and export it
+        }
+        else if((v = findvar(argv[i], len)) && !v->exported){                       //If NAME is set but private
+            v->exported = 1;                                                        //export it
+            envdirty = 1;
+        }
+    }
+    return;
+}
+
+/*
+ * do_unset - Execute the builtin unset command
+ */
+void do_unset(char **argv)
+{
+    size_t len;
+    int i;
+
+    for(i = 1; argv[i]; i++){
+        len = varname(argv[i]);
+        if(!len || argv[i][len]){                                                   //If not a NAME
+            printf("unset: `%s': not a valid identifier\n", argv[i]);               //throw error
+            continue;
+        }
+        unsetvar(argv[i], len);                                                     //Forget the variable
+    }
+    return;
+}
+
+/*
+ * waitfg - Block until the job of process pid is no longer the
+ *     foreground job. A command list stays in the foreground through
+ *     all of its steps, so the job is followed by its job ID, and the
+ *     steps are started from here as the ones before them are reaped.
+ */
+void waitfg(pid_t pid)
+{
+    struct job_t *fg_job = getjobpid(jobs, pid);                                    //Get the foreground job
+    sigset_t chld, prev, wait;                                                      //SIGCHLD, the mask to restore and to wait with
+    int jid;
+
+    if(!fg_job){                                                                    //If no foreground job
+        return;                                                                     //return without doing anything
+    }
+    jid = fg_job->jid;
+
+    Sigemptyset(&chld);
+    Sigaddset(&chld, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &chld, &prev);                                           //No reaping between test and wait
+    wait = prev;
+    sigdelset(&wait, SIGCHLD);
+    advancejobs();                                                                  //Reaped before we got here
+    while(fg_job->jid == jid && fg_job->state == FG){                               //If job is FG
+        sigsuspend(&wait);                                                          //then sleep until a signal is handled
+        advancejobs();                                                              //and start the next step, if any
+    }
+    Sigprocmask(SIG_SETMASK, &prev, NULL);
+    return;
+}
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.  
+ *
+ *     In subreaper mode (-r) the shell also inherits the orphaned
+ *     descendants of its jobs. These are charged to the job whose
+ *     process group they belong to, and a job is only removed once
+ *     every process in its group is gone. Descendants that moved to a
+ *     process group of their own with setpgid() are reaped, but not
+ *     accounted to any job, and don't keep it listed.
+ *
+ *     When the running step of a job is done, the job is only marked
+ *     as reaped. The next step of its command list, or the jobs waiting
+ *     for it, are started by advancejobs() once the shell is back from
+ *     its idle point, as steps may be builtins that wait themselves.
+ */
+void sigchld_handler(int sig) 
+{
+    pid_t child_pid;                                                                //Stores the child pid
+    pid_t pgid;                                                                     //Process group of the child
+    int status;                                                                     //Status variable
+    struct rusage ru;                                                               //Resources used by the child
+    int olderrno = errno;                                                           //jobdone() clobbers errno
+
+    while((child_pid = reapchild(&status, &pgid, &ru)) > 0){                        //Get the child pid in the loop
+        struct job_t *jd = getjobpid(jobs, child_pid);                              //Get job detail of the child
+        if(!WIFSTOPPED(status)){                                                    //A cached command is recorded
+            cachereaped(child_pid, status);                                         //by advancejobs()
+        }
+        if(!jd && subreaper){                                                       //If not a job leader
+            jd = getjobpid(jobs, pgid);                                             //attribute it to its process group
+        }
+        if(!jd){                                                                    //If no job
+            if(subreaper){                                                          //Adopted orphan from outside our jobs
+                continue;                                                           //nothing to account it to
+            }
+            printf("((%d): No such child", child_pid);                              //Throw error
+            errno = olderrno;
+            return;
+        }
+
+        if(!WIFSTOPPED(status)){                                                    //If the process is gone
+            timeradd(&jd->utime, &ru.ru_utime, &jd->utime);                         //Charge its user time to the job
+            timeradd(&jd->stime, &ru.ru_stime, &jd->stime);                         //Charge its system time to the job
         }
 
         if(WIFSTOPPED(status)){                                                     //If stopped
-            jd->state = ST;                                                         //Change state of job to stopped
-            printf("Job [%d] (%d) stopped by signal 20\n",jd->jid, child_pid);      //print the message
+            if(jd->state != ST){                                                    //Report each job only once
+                if(jd->state == FG){
+                    laststatus = 128 + WSTOPSIG(status);                            //$? of a stopped foreground job
+                }
+                jd->state = ST;                                                     //Change state of job to stopped
+                printf("Job [%d] (%d) stopped by signal %d\n",jd->jid, child_pid, WSTOPSIG(status));
+            }
+        }
+
+        else if(jd->pid != child_pid){                                              //If an adopted descendant exited
+            if(jobdone(jd)){                                                        //and it was the last of the job
+                jd->reaped = 1;                                                     //Move on to the next step
+            }
         }
 
         else if(WIFSIGNALED(status)){                                               //If signalled
-            deletejob(jobs, child_pid);                                             //Delete job from jobs list
-            printf("Job [%d] (%d) terminated by signal 2\n", jd->jid, child_pid);
+            printf("Job [%d] (%d) terminated by signal %d\n", jd->jid, child_pid, WTERMSIG(status));
+            jd->status = 128 + WTERMSIG(status);
+            free(jd->list);                                                         //A killed step ends its list
+            jd->list = NULL;
+            if(!subreaper || jobdone(jd)){                                          //Unless descendants live on
+                jd->reaped = 1;                                                     //Delete job from jobs list
+            }
         }
 
         else if(WIFEXITED(status)){                                                 //If exited
-            deletejob(jobs, child_pid);                                             //Delete from jobs list
+            jd->status = WEXITSTATUS(status);                                       //Keep its status for the next step
+            if(!subreaper || jobdone(jd)){                                          //Unless descendants live on
+                jd->reaped = 1;                                                     //Move on to the next step
+            }
         }
 
         else{                                                                       //If nothing
             unix_error("waitpid error");                                            //throw error
         }
     }
+    errno = olderrno;
     return;
 }
 
@@ -419,11 +1500,13 @@ void sigchld_handler(int sig)
 void sigint_handler(int sig) 
 {
     pid_t fpid;                                                                     //Stores the pid of the foreground job
+    int olderrno = errno;                                                           //Don't clobber errno of interrupted code
     fpid = fgpid(jobs);                                                             //get the pid of the foreground job
 
-    if(fpid > 0){                                                                   //If there is a running foreground job
-        Kill(-fpid, SIGINT);                                                        //Send SIGINT signal to all the processes in the foreground job
+    if(fpid > 0 && kill(-fpid, SIGINT) < 0 && errno != ESRCH){                      //Forward to the foreground job, which may have just been reaped
+        unix_error("Fatal: Kill Error!");                                           //throw error
     }
+    errno = olderrno;
     return;
 }
 
@@ -435,11 +1518,13 @@ void sigint_handler(int sig)
 void sigtstp_handler(int sig) 
 {
     pid_t fpid;                                                                     //Stores the pid of the foreground job
+    int olderrno = errno;                                                           //Don't clobber errno of interrupted code
     fpid = fgpid(jobs);                                                             //get the pid of the foreground job
 
-    if(fpid > 0){                                                                   //If there is a running foreground job
-        Kill(-fpid, SIGTSTP);                                                       //Send SIGTSTP signal to all the processes in the foreground job
+    if(fpid > 0 && kill(-fpid, SIGTSTP) < 0 && errno != ESRCH){                     //Forward to the foreground job, which may have just been reaped
+        unix_error("Fatal: Kill Error!");                                           //throw error
     }
+    errno = olderrno;
     return;
 }
 
@@ -455,8 +1540,16 @@ void sigtstp_handler(int sig)
 void clearjob(struct job_t *job) {
     job->pid = 0;
     job->jid = 0;
+    job->leader = 0;
     job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    job->status = 0;
+    job->list = NULL;
+    job->after = 0;
+    job->reaped = 0;
+    free(job->cmdline);
+    job->cmdline = NULL;
+    timerclear(&job->utime);
+    timerclear(&job->stime);
 }
 
 /* initjobs - Initialize the job list */
@@ -483,17 +1576,19 @@ int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline)
 {
     int i;
     
-    if (pid < 1)
+    if (pid < 1 && state != WT) /* only a waiting job has no pid yet */
 	return 0;
 
     for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid == 0) {
+	if (jobs[i].jid == 0) {
 	    jobs[i].pid = pid;
+	    jobs[i].leader = pid;
 	    jobs[i].state = state;
 	    jobs[i].jid = nextjid++;
 	    if (nextjid > MAXJOBS)
 		nextjid = 1;
-	    strcpy(jobs[i].cmdline, cmdline);
+	    if (!(jobs[i].cmdline = strdup(cmdline)))
+		app_error("addjob: out of memory");
   	    if(verbose){
 	        printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
             }
@@ -557,6 +1652,19 @@ struct job_t *getjobjid(struct job_t *jobs, int jid)
     return NULL;
 }
 
+/* getjobleader - Find a job (by the PID of its first step) on the job list */
+struct job_t *getjobleader(struct job_t *jobs, pid_t pid) 
+{
+    int i;
+
+    if (pid < 1)
+	return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+	if (jobs[i].pid != 0 && jobs[i].leader == pid)
+	    return &jobs[i];
+    return NULL;
+}
+
 /* pid2jid - Map process ID to job ID */
 int pid2jid(pid_t pid) 
 {
@@ -577,7 +1685,7 @@ void listjobs(struct job_t *jobs)
     int i;
     
     for (i = 0; i < MAXJOBS; i++) {
-	if (jobs[i].pid != 0) {
+	if (jobs[i].jid != 0 && (jobs[i].pid != 0 || jobs[i].state == WT)) {
 	    printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
 	    switch (jobs[i].state) {
 		case BG: 
@@ -589,6 +1697,9 @@ void listjobs(struct job_t *jobs)
 		case ST: 
 		    printf("Stopped ");
 		    break;
+		case WT: 
+		    printf("Waiting ");
+		    break;
 	    default:
 		    printf("listjobs: Internal error: job[%d].state=%d ", 
 			   i, jobs[i].state);
@@ -597,69 +1708,2438 @@ void listjobs(struct job_t *jobs)
 	}
     }
 }
-/******************************
- * end job list helper routines
- ******************************/
-
-
-/***********************
- * Other helper routines
- ***********************/
 
 /*
- * usage - print a help message
+ * jobdone - Return true if no process is left in the job's process
+ *     group. Descendants that left the group aren't seen.
  */
-void usage(void) 
+int jobdone(struct job_t *job)
 {
-    printf("Usage: shell [-hvp]\n");
-    printf("   -h   print this message\n");
-    printf("   -v   print additional diagnostic information\n");
-    printf("   -p   do not emit a command prompt\n");
-    exit(1);
+    return kill(-job->pid, 0) < 0 && errno == ESRCH;
 }
 
 /*
- * unix_error - unix-style error routine
+ * finishjob - Delete a completed job, reporting its resource usage,
+ *     and let the jobs waiting for it know
  */
-void unix_error(char *msg)
+void finishjob(struct job_t *job)
 {
-    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
-    exit(1);
+    int jid = job->jid, status = job->status;
+
+    if (job->state == FG)
+	laststatus = job->status;
+    free(job->list);
+    if (jobd.fd >= 0)
+	jobdrecord(job);
+    if (verbose)
+	printf("Job [%d] (%d) used %ld.%06lds user %ld.%06lds sys\n",
+	       job->jid, job->leader,
+	       (long)job->utime.tv_sec, (long)job->utime.tv_usec,
+	       (long)job->stime.tv_sec, (long)job->stime.tv_usec);
+    clearjob(job); /* by slot, as a waiting job has no pid */
+    nextjid = maxjid(jobs)+1;
+    afterdone(job - jobs, jid, status);
 }
 
 /*
- * app_error - application-style error routine
+ * stepdone - The running step of a job is done: start the next step
+ *     of its command list, or delete the job if there is none. The job
+ *     has no process while builtins of the list run, so jobs leaves it
+ *     out.
  */
-void app_error(char *msg)
+void stepdone(struct job_t *job)
 {
-    fprintf(stdout, "%s\n", msg);
-    exit(1);
+    sigset_t mask;
+    pid_t pid;
+
+    job->pid = 0;
+    if (job->list) {
+	job->list->status = job->status;
+	if ((pid = runlist(job->list))) { /* SIGINT, SIGTSTP come back blocked */
+	    job->pid = pid;
+	    Sigemptyset(&mask);
+	    Sigaddset(&mask, SIGINT);
+	    Sigaddset(&mask, SIGTSTP);
+	    Sigprocmask(SIG_UNBLOCK, &mask, NULL);
+	    return;
+	}
+	job->status = job->list->status; /* builtins ended the list */
+    }
+    finishjob(job);
 }
 
 /*
- * Signal - wrapper for the sigaction function
+ * afterstart - Start a waiting job whose jobs have all succeeded, as
+ *     a background job
  */
-handler_t *Signal(int signum, handler_t *handler) 
+void afterstart(struct job_t *job)
 {
-    struct sigaction action, old_action;
+    sigset_t mask;
+    pid_t pid;
 
-    action.sa_handler = handler;  
-    sigemptyset(&action.sa_mask); /* block sigs of type being handled */
-    action.sa_flags = SA_RESTART; /* restart syscalls if possible */
+    job->list->status = 0;
+    job->state = BG; /* not waiting now, and left out by jobs until forked */
+    if (!(pid = runlist(job->list))) { /* builtins were all there was */
+	job->status = job->list->status;
+	finishjob(job);
+	return;
+    }
+    job->pid = job->leader = pid;
+    if (job->list->next == job->list->nsteps) { /* nothing left to run */
+	free(job->list);
+	job->list = NULL;
+    }
+    Sigemptyset(&mask);
+    Sigaddset(&mask, SIGINT);
+    Sigaddset(&mask, SIGTSTP);
+    Sigprocmask(SIG_UNBLOCK, &mask, NULL);
+    printf("[%d] (%d) %s", job->jid, job->pid, job->cmdline);
+    fflush(stdout); /* ahead of the job's own output, mostly */
+}
 
-    if (sigaction(signum, &action, &old_action) < 0)
-	unix_error("Signal error");
-    return (old_action.sa_handler);
+/*
+ * afterdone - The job numbered jid in slot slot of the job list is done
+ *     with the given status. Start the jobs that were only waiting for
+ *     it, if it succeeded, or fail all that were waiting for it if not.
+ *     A failed job is done in turn, so the failure spreads down the
+ *     chain of jobs waiting for each other.
+ */
+void afterdone(int slot, int jid, int status)
+{
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].state != WT || !(jobs[i].after & (1u << slot)))
+	    continue;
+	jobs[i].after &= ~(1u << slot);
+	if (status) {
+	    printf("Job [%d] not run: job [%d] failed\n", jobs[i].jid, jid);
+	    fflush(stdout);
+	    jobs[i].status = status;
+	    finishjob(&jobs[i]);
+	}
+	else if (!jobs[i].after)
+	    afterstart(&jobs[i]);
+    }
 }
 
 /*
- * sigquit_handler - The driver program can gracefully terminate the
- *    child shell by sending it a SIGQUIT signal.
+ * advancejobs - Move on the jobs whose running step sigchld_handler
+ *     reaped: start the next step of each one's command list, or delete
+ *     it and start the jobs waiting for it. Cached commands that were
+ *     reaped are recorded first, for the steps to find. Called with
+ *     SIGCHLD blocked wherever the shell has just let it in.
  */
-void sigquit_handler(int sig) 
+void advancejobs(void)
 {
-    printf("Terminating after receipt of SIGQUIT signal\n");
-    exit(1);
+    int i;
+
+    cachedone();
+    for (i = 0; i < MAXJOBS; i++) {
+	if (jobs[i].reaped) {
+	    jobs[i].reaped = 0; /* before a builtin step gets here again */
+	    stepdone(&jobs[i]);
+	}
+    }
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+
+/*********************************************
+ * Helper routines for the persistent history
+ *********************************************/
+
+/*
+ * The history is an append-only log with one command per line, shared
+ * by every shell started with the same -H file. Each instance appends
+ * whole lines with O_APPEND, so concurrent writers never interleave.
+ *
+ * Next to the log lives <file>.idx, an index of the distinct commands
+ * in a prefix of the log: their offsets sorted by command text, plus
+ * the largest offset in every block of HISTBLOCK sorted entries. Both
+ * files are mmap'd, so startup only parses the log lines written after
+ * the index (the tail). Once the tail grows past HISTTAIL lines it is
+ * merged into a new index, which is renamed over the old one under an
+ * flock on the log.
+ */
+
+/**
+ * @brief histcmp Compare two history entries, each ending in '\n'
+ * @return <0, 0 or >0 like strcmp, with a shorter entry sorting first
+ */
+int histcmp(const char *a, const char *b){
+    while(*a == *b && *a != '\n'){                                                          //Skip the common prefix
+        a++;
+        b++;
+    }
+    return (*a == '\n' ? -1 : (unsigned char)*a) - (*b == '\n' ? -1 : (unsigned char)*b);
+}
+
+/**
+ * @brief histcmpn Compare the first plen characters of an entry with a prefix
+ * @return <0, 0 or >0, with 0 meaning the entry starts with the prefix
+ */
+int histcmpn(const char *entry, const char *prefix, size_t plen){
+    size_t i;
+    int c;
+
+    for(i = 0; i < plen; i++){
+        c = entry[i] == '\n' ? -1 : (unsigned char)entry[i];                                //The end of the entry sorts first
+        if(c != (unsigned char)prefix[i]){
+            return c - (unsigned char)prefix[i];
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief histsort qsort comparator for log offsets: by text, newest first
+ */
+int histsort(const void *a, const void *b){
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    int c = histcmp(hist.log + x, hist.log + y);
+
+    if(c){
+        return c;
+    }
+    return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+/**
+ * @brief histmap Map the whole log, following appends from other shells
+ */
+void histmap(void){
+    struct stat st;
+
+    if(fstat(hist.fd, &st) < 0){
+        unix_error("history fstat error");
+    }
+    if((size_t)st.st_size == hist.loglen){                                                  //Nothing appended since last time
+        return;
+    }
+
+    if(hist.log){
+        munmap(hist.log, hist.loglen);
+    }
+    hist.log = NULL;
+    hist.loglen = st.st_size;
+    if(hist.loglen && (hist.log = mmap(NULL, hist.loglen, PROT_READ, MAP_SHARED, hist.fd, 0)) == MAP_FAILED){
+        unix_error("history mmap error");
+    }
+
+    if(hist.loglen < hist.scanned){                                                         //The log was truncated under us
+        hist.idxino = 0;                                                                    //so neither index nor tail holds
+        hist.nentries = hist.nuniq = 0;
+        hist.scanned = 0;
+        hist.ntail = 0;
+    }
+}
+
+/**
+ * @brief histloadidx Map the index file if another shell has replaced it
+ */
+void histloadidx(void){
+    struct stat st, logst;
+    struct histidx_t *idx;
+    int fd;
+    size_t nblocks;
+
+    if(stat(hist.idxpath, &st) < 0 || st.st_ino == hist.idxino){                            //No index, or the one we have
+        return;
+    }
+    if((fd = open(hist.idxpath, O_RDONLY)) < 0){
+        return;
+    }
+    if(fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(struct histidx_t) ||
+       (idx = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED){
+        close(fd);
+        return;
+    }
+    close(fd);
+
+    fstat(hist.fd, &logst);
+    nblocks = (idx->nuniq + HISTBLOCK - 1) / HISTBLOCK;
+    if(idx->magic != HISTMAGIC || idx->blocksize != HISTBLOCK ||                            //Ignore an index that isn't ours,
+       idx->logino != logst.st_ino || idx->covered > hist.loglen ||                         //is for another log,
+       (size_t)st.st_size != sizeof(*idx) + (idx->nuniq + nblocks) * sizeof(uint64_t)){     //or is cut short
+        munmap(idx, st.st_size);
+        return;
+    }
+
+    if(hist.idx){
+        munmap(hist.idx, hist.idxlen);
+    }
+    hist.idx = idx;
+    hist.idxlen = st.st_size;
+    hist.idxino = st.st_ino;
+    hist.off = (uint64_t *)(idx + 1);                                                       //Sorted offsets follow the header
+    hist.blockmax = hist.off + idx->nuniq;                                                  //then the per-block maxima
+    hist.nentries = idx->nentries;
+    hist.nuniq = idx->nuniq;
+    hist.scanned = idx->covered;                                                            //The tail starts after the index
+    hist.ntail = 0;
+}
+
+/**
+ * @brief histscan Add the complete lines appended since the last scan to the tail
+ */
+void histscan(void){
+    char *p, *nl, *end = hist.log + hist.loglen;
+
+    for(p = hist.log + hist.scanned; p < end && (nl = memchr(p, '\n', end - p)); p = nl + 1){
+        if(hist.ntail == hist.tailcap){                                                     //Grow the tail array
+            hist.tailcap = hist.tailcap ? 2 * hist.tailcap : HISTTAIL;
+            if(!(hist.tail = realloc(hist.tail, hist.tailcap * sizeof(uint64_t)))){
+                app_error("history: out of memory");
+            }
+        }
+        hist.tail[hist.ntail++] = p - hist.log;
+        hist.scanned = nl + 1 - hist.log;                                                   //A partial line waits for its writer
+    }
+}
+
+/**
+ * @brief histrebuild Merge the tail into a new index file
+ */
+void histrebuild(void){
+    uint64_t *t, *out, *blockmax;
+    size_t i, j, k, nt, nblocks;
+    struct histidx_t hdr;
+    struct stat logst;
+    char tmp[MAXLINE];
+    FILE *fp;
+    int fd;
+
+    if(flock(hist.fd, LOCK_EX) < 0){                                                        //One rebuilder at a time
+        return;
+    }
+    histmap();
+    histloadidx();                                                                          //Someone may have beaten us to it
+    histscan();
+    if(hist.ntail <= HISTTAIL){
+        flock(hist.fd, LOCK_UN);
+        return;
+    }
+
+    t = malloc(hist.ntail * sizeof(uint64_t));
+    out = malloc((hist.nuniq + hist.ntail) * sizeof(uint64_t));
+    blockmax = malloc(((hist.nuniq + hist.ntail) / HISTBLOCK + 1) * sizeof(uint64_t));
+    if(!t || !out || !blockmax){
+        app_error("history: out of memory");
+    }
+
+    memcpy(t, hist.tail, hist.ntail * sizeof(uint64_t));                                    //Sort the tail, newest first
+    qsort(t, hist.ntail, sizeof(uint64_t), histsort);                                       //among equal commands
+    for(i = nt = 0; i < hist.ntail; i++){                                                   //and keep only the newest
+        if(!nt || histcmp(hist.log + t[nt-1], hist.log + t[i])){
+            t[nt++] = t[i];
+        }
+    }
+
+    for(i = j = k = 0; i < hist.nuniq || j < nt; ){                                         //Merge with the old index
+        int c = i == hist.nuniq ? 1 : (j == nt ? -1 : histcmp(hist.log + hist.off[i], hist.log + t[j]));
+        if(c < 0){
+            out[k++] = hist.off[i++];
+        }
+        else{
+            if(c == 0){                                                                     //The tail copy is newer
+                i++;
+            }
+            out[k++] = t[j++];
+        }
+    }
+
+    nblocks = (k + HISTBLOCK - 1) / HISTBLOCK;
+    for(i = 0; i < k; i++){                                                                 //Newest offset in every block
+        if(i % HISTBLOCK == 0 || out[i] > blockmax[i / HISTBLOCK]){
+            blockmax[i / HISTBLOCK] = out[i];
+        }
+    }
+
+    fstat(hist.fd, &logst);
+    hdr.magic = HISTMAGIC;
+    hdr.blocksize = HISTBLOCK;
+    hdr.logino = logst.st_ino;
+    hdr.covered = hist.scanned;
+    hdr.nentries = hist.nentries + hist.ntail;
+    hdr.nuniq = k;
+
+    snprintf(tmp, sizeof(tmp), "%s.%d", hist.idxpath, (int)getpid());                       //Build aside, then swap it in
+    fd = open(tmp, O_WRONLY|O_CREAT|O_TRUNC, 0600);                                         //As private as the log
+    if((fp = fd < 0 ? NULL : fdopen(fd, "w")) &&
+       fwrite(&hdr, sizeof(hdr), 1, fp) == 1 &&
+       fwrite(out, sizeof(uint64_t), k, fp) == k &&
+       fwrite(blockmax, sizeof(uint64_t), nblocks, fp) == nblocks &&
+       fclose(fp) == 0){
+        rename(tmp, hist.idxpath);
+        histloadidx();
+    }
+    else{
+        if(fp){
+            fclose(fp);
+        }
+        else if(fd >= 0){
+            close(fd);
+        }
+        unlink(tmp);
+        printf("history: can't write %s: %s\n", hist.idxpath, strerror(errno));
+    }
+
+    flock(hist.fd, LOCK_UN);
+    free(t);
+    free(out);
+    free(blockmax);
+}
+
+/**
+ * @brief histsync Catch up with the log and index as left by all shells
+ */
+void histsync(void){
+    histmap();
+    histloadidx();
+    histscan();
+    if(hist.ntail > HISTTAIL){                                                              //Tail too long to scan cheaply
+        histrebuild();
+    }
+}
+
+/**
+ * @brief histinit Open (creating if need be) the history log at path
+ * @param path The history log file
+ */
+void histinit(char *path){
+    if((hist.fd = open(path, O_RDWR|O_APPEND|O_CREAT|O_CLOEXEC, 0600)) < 0){
+        unix_error("history open error");
+    }
+    if(!(hist.idxpath = malloc(strlen(path) + 5))){
+        app_error("history: out of memory");
+    }
+    sprintf(hist.idxpath, "%s.idx", path);
+    histsync();
+}
+
+/**
+ * @brief histadd Append a command line to the history
+ * @param cmdline The command line, ending in '\n'
+ */
+void histadd(char *cmdline){
+    size_t len = strlen(cmdline);
+
+    if(hist.fd < 0 || strspn(cmdline, " \t\n") == len || cmdline[len-1] != '\n'){            //No history, blank or cut short
+        return;
+    }
+    if(write(hist.fd, cmdline, len) != len){                                                //One write keeps the line whole
+        printf("history: write error: %s\n", strerror(errno));
+    }
+}
+
+/**
+ * @brief histfind Find the most recent entry starting with a prefix
+ * @param prefix The prefix to look for
+ * @param plen The length of the prefix
+ * @return The entry inside the mapped log, NULL if there is none
+ */
+char *histfind(const char *prefix, size_t plen){
+    size_t lo, hi, mid, end;
+    uint64_t best;
+    long t;
+
+    histsync();
+    for(t = (long)hist.ntail - 1; t >= 0; t--){                                             //The tail is newer than the index
+        if(!histcmpn(hist.log + hist.tail[t], prefix, plen)){
+            return hist.log + hist.tail[t];
+        }
+    }
+
+    for(lo = 0, hi = hist.nuniq; lo < hi; ){                                                //First entry >= prefix
+        mid = (lo + hi) / 2;
+        if(histcmpn(hist.log + hist.off[mid], prefix, plen) < 0) lo = mid + 1; else hi = mid;
+    }
+    for(end = lo, hi = hist.nuniq; end < hi; ){                                             //First entry past the prefix
+        mid = (end + hi) / 2;
+        if(histcmpn(hist.log + hist.off[mid], prefix, plen) <= 0) end = mid + 1; else hi = mid;
+    }
+    if(lo == end){
+        return NULL;
+    }
+
+    best = hist.off[lo];                                                                    //Newest offset in [lo, end)
+    while(lo < end && lo % HISTBLOCK){
+        best = hist.off[lo] > best ? hist.off[lo] : best;
+        lo++;
+    }
+    for(; lo + HISTBLOCK <= end; lo += HISTBLOCK){                                          //Whole blocks use their maxima
+        best = hist.blockmax[lo / HISTBLOCK] > best ? hist.blockmax[lo / HISTBLOCK] : best;
+    }
+    for(; lo < end; lo++){
+        best = hist.off[lo] > best ? hist.off[lo] : best;
+    }
+    return hist.log + best;
+}
+
+/**
+ * @brief histlist List the last n history entries, or every entry
+ *     containing pattern. Both print straight from the mapped log,
+ *     oldest first. Only prefixes are indexed: a pattern is found by
+ *     a linear scan of the whole log.
+ * @param n How many entries to list
+ * @param pattern Text the listed entries must contain, or NULL
+ */
+void histlist(unsigned long n, const char *pattern){
+    size_t plen = pattern ? strlen(pattern) : 0;
+    char *p, *end, *hit, *nl;
+    unsigned long num, total;
+
+    histsync();
+    end = hist.log + hist.scanned;
+    p = hist.log;
+    num = 1;                                                                                //Number of the entry at p
+    if(!pattern){
+        total = hist.nentries + hist.ntail;
+        if(n > total){
+            n = total;
+        }
+        for(p = end; n > 0 && p > hist.log; n--, total--){                                  //Walk back n lines
+            nl = memrchr(hist.log, '\n', p - 1 - hist.log);
+            p = nl ? nl + 1 : hist.log;
+        }
+        num = total + 1;
+    }
+
+    while(p < end){
+        if(pattern){
+            if(!(hit = memmem(p, end - p, pattern, plen))){                                 //No more matches
+                break;
+            }
+            for(; (nl = memchr(p, '\n', hit - p)); p = nl + 1){                             //Skip to the line it is in
+                num++;
+            }
+        }
+        if(!(nl = memchr(p, '\n', end - p))){
+            break;
+        }
+        if(!pattern || nl >= hit + plen){                                                   //Not a match across lines
+            printf("%6lu  %.*s\n", num, (int)(nl - p), p);
+        }
+        p = nl + 1;
+        num++;
+    }
+}
+
+/**
+ * @brief histexpand Replace a !prefix command line with the newest entry
+ *     starting with prefix (!! stands for the previous command) and echo it
+ * @param line The command line, rewritten in place
+ * @param cap The allocated size of *line, which grows if need be
+ * @return 1 if *line holds a command to run, 0 if nothing matched
+ */
+int histexpand(char **line, size_t *cap){
+    char *cmdline = *line, *entry;
+    size_t plen, len;
+
+    if(cmdline[0] != '!'){                                                                  //Nothing to expand
+        return 1;
+    }
+    if(hist.fd < 0){
+        printf("history: no history file (use -H)\n");
+        return 0;
+    }
+
+    plen = strcspn(cmdline + 1, "\n");
+    if(plen == 1 && cmdline[1] == '!'){                                                     //!! matches anything
+        plen = 0;
+    }
+    if(!(entry = histfind(cmdline + 1, plen))){
+        printf("%.*s: event not found\n", (int)plen + 1, cmdline);
+        return 0;
+    }
+
+    len = (char *)memchr(entry, '\n', hist.log + hist.loglen - entry) - entry + 1;
+    if(len >= *cap){                                                                        //Make room for it
+        if(!(cmdline = realloc(cmdline, len + 1))){
+            app_error("history: out of memory");
+        }
+        *line = cmdline;
+        *cap = len + 1;
+    }
+    memcpy(cmdline, entry, len);
+    cmdline[len] = '\0';
+    printf("%s", cmdline);                                                                  //Show what is being run
+    fflush(stdout);                                                                         //before the job's own output
+    return 1;
+}
+/*****************************************
+ * end helper routines for the history
+ *****************************************/
+
+
+/*****************************************************
+ * Helper routines for variable and glob expansion
+ *****************************************************/
+
+/*
+ * Expanded words are packed into one reusable buffer, so a command
+ * line costs no allocations once the buffers have grown to fit. The
+ * words are recorded as offsets while the buffer may still move, and
+ * turned into the argv array at the end.
+ *
+ * Directory listings read for globbing are kept sorted in dircache,
+ * keyed by directory name. A listing is reused while the directory's
+ * mtime and inode are unchanged. A listing read within a second of the
+ * directory's last change is racy: a change in the same timestamp tick
+ * would not move the mtime, so such listings are always re-read.
+ */
+
+/**
+ * @brief xgrow Make room for n more bytes in the expansion buffer
+ */
+void xgrow(size_t n){
+    if(xpand.len + n <= xpand.cap){
+        return;
+    }
+    while(xpand.len + n > xpand.cap){
+        xpand.cap = xpand.cap ? 2 * xpand.cap : MAXLINE;
+    }
+    if(!(xpand.buf = realloc(xpand.buf, xpand.cap))){
+        app_error("expand: out of memory");
+    }
+}
+
+/**
+ * @brief xputs Append n bytes of s to the word being expanded
+ */
+void xputs(const char *s, size_t n){
+    if(n == 0){                                                                             //xpand.buf may not exist yet
+        return;
+    }
+    xgrow(n);
+    memcpy(xpand.buf + xpand.len, s, n);
+    xpand.len += n;
+}
+
+/**
+ * @brief xendword End the word that starts at offset start
+ */
+void xendword(size_t start){
+    xputs("", 1);                                                                           //NUL-terminate it
+    xaddword(NULL);
+    xpand.off[xpand.argc - 1] = start;
+}
+
+/**
+ * @brief xaddword Add a word that is used where it is, without copying
+ *     it, or with NULL make room for a word in the buffer
+ */
+void xaddword(char *word){
+    if(xpand.argc + 1 >= xpand.argcap){                                                     //Room for it and the NULL
+        xpand.argcap = xpand.argcap ? 2 * xpand.argcap : MAXARGS;
+        if(!(xpand.off = realloc(xpand.off, xpand.argcap * sizeof(size_t))) ||
+           !(xpand.argv = realloc(xpand.argv, xpand.argcap * sizeof(char *)))){
+            app_error("expand: out of memory");
+        }
+    }
+    xpand.off[xpand.argc] = XINPLACE;
+    xpand.argv[xpand.argc++] = word;
+}
+
+/**
+ * @brief xunescape Remove the backslashes that quote characters in s[0..n)
+ * @return The new length
+ */
+size_t xunescape(char *s, size_t n){
+    char *in = s, *out = s, *end = s + n;
+
+    while(in < end){
+        if(*in == '\\' && in + 1 < end){                                                  //\c is c
+            in++;
+        }
+        *out++ = *in++;
+    }
+    return out - s;
+}
+
+/**
+ * @brief dirlist Return the sorted listing of a directory, reading it
+ *     only if the cached one may be out of date
+ * @param dir The directory, "" for the current one
+ * @return The listing, NULL if the directory can't be read
+ */
+struct dircache_t *dirlist(const char *dir){
+    struct dircache_t *dc;
+    struct dirent *de;
+    struct stat st;
+    size_t len;
+    DIR *dp;
+
+    dc = &dircache[fnvhash(dir, strlen(dir)) % DIRCACHE];
+    if(!*dir){
+        dir = ".";
+    }
+
+    if(stat(dir, &st) < 0){
+        return NULL;
+    }
+    if(dc->path && !strcmp(dc->path, dir) && !dc->racy &&                                   //Same directory, unchanged
+       dc->dev == st.st_dev && dc->ino == st.st_ino &&
+       dc->mtime.tv_sec == st.st_mtim.tv_sec && dc->mtime.tv_nsec == st.st_mtim.tv_nsec){
+        return dc;
+    }
+
+    if(!(dp = opendir(dir))){
+        return NULL;
+    }
+    if(!dc->path || strcmp(dc->path, dir)){                                                 //Take over the slot
+        free(dc->path);
+        if(!(dc->path = strdup(dir))){
+            app_error("expand: out of memory");
+        }
+    }
+    dc->dev = st.st_dev;
+    dc->ino = st.st_ino;
+    dc->mtime = st.st_mtim;
+    dc->racy = racy(&st);
+    dc->len = dc->n = 0;
+
+    while((de = readdir(dp))){
+        if(!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..")){                          //Globs never match these
+            continue;
+        }
+        len = strlen(de->d_name) + 1;
+        if(dc->len + len > dc->cap){                                                        //Grow the name buffer
+            while(dc->len + len > dc->cap){
+                dc->cap = dc->cap ? 2 * dc->cap : 4096;
+            }
+            if(!(dc->names = realloc(dc->names, dc->cap))){
+                app_error("expand: out of memory");
+            }
+        }
+        if(dc->n == dc->ncap){                                                              //Grow the name index
+            dc->ncap = dc->ncap ? 2 * dc->ncap : 256;
+            if(!(dc->off = realloc(dc->off, dc->ncap * sizeof(size_t)))){
+                app_error("expand: out of memory");
+            }
+        }
+        memcpy(dc->names + dc->len, de->d_name, len);
+        dc->off[dc->n++] = dc->len;
+        dc->len += len;
+    }
+    closedir(dp);
+
+    if(dc->n > 0){                                                                          //An empty one has no index
+        dirsortbase = dc->names;                                                            //Sort the names once per read
+        qsort(dc->off, dc->n, sizeof(size_t), dirsort);
+    }
+    return dc;
+}
+
+/**
+ * @brief dirsort qsort comparator for offsets into dirsortbase
+ */
+int dirsort(const void *a, const void *b){
+    return strcmp(dirsortbase + *(const size_t *)a, dirsortbase + *(const size_t *)b);
+}
+
+/**
+ * @brief dirfirst Return the index of the first name in a listing that
+ *     sorts at or after the literal prefix of a pattern
+ * @param dc The listing
+ * @param prefix The pattern, whose first plen characters are literal
+ * @param plen The length of the literal prefix
+ */
+size_t dirfirst(struct dircache_t *dc, const char *prefix, size_t plen){
+    size_t lo = 0, hi = dc->n, mid;
+
+    while(lo < hi){                                                                         //Binary search the sorted names
+        mid = (lo + hi) / 2;
+        if(strncmp(dc->names + dc->off[mid], prefix, plen) < 0) lo = mid + 1; else hi = mid;
+    }
+    return lo;
+}
+
+/**
+ * @brief hasglob Return true if s contains a glob metacharacter that
+ *     isn't quoted with a backslash
+ */
+int hasglob(const char *s){
+    for(; *s; s++){
+        if(*s == '\\' && s[1]){                                                           //\* is a plain *
+            s++;
+        }
+        else if(*s == '*' || *s == '?' || *s == '['){
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief globpath Match the rest of a pattern below a directory and add
+ *     every existing path that matches as a word
+ * @param path The directory matched so far, ending in '/' or empty; the
+ *     buffer holds PATH_MAX bytes and is used as scratch space
+ * @param plen The length of path
+ * @param pat The rest of the pattern
+ * @return The number of words added
+ */
+int globpath(char *path, size_t plen, const char *pat){
+    const char *slash = strchr(pat, '/');
+    const char *rest;
+    size_t clen = slash ? (size_t)(slash - pat) : strlen(pat);
+    char comp[NAME_MAX + 1];
+    char *names, *name;
+    struct dircache_t *dc;
+    struct stat st;
+    size_t i, nlen, len, lit;
+    int n = 0;
+
+    if(clen > NAME_MAX || plen + clen + 2 > PATH_MAX){                                      //Can't name anything
+        return 0;
+    }
+    memcpy(comp, pat, clen);
+    comp[clen] = '\0';
+    while(slash && slash[1] == '/'){                                                        //a//b is a/b
+        slash++;
+    }
+    rest = slash && slash[1] ? slash + 1 : NULL;                                            //Components left after this one
+
+    if(!hasglob(comp)){                                                                     //Literal component
+        memcpy(path + plen, comp, clen);
+        plen += xunescape(path + plen, clen);
+        if(slash){
+            path[plen++] = '/';
+        }
+        if(rest){                                                                           //Match the rest below it
+            return globpath(path, plen, rest);
+        }
+        path[plen] = '\0';
+        if((slash ? stat(path, &st) : lstat(path, &st)) < 0){                               //It has to exist
+            return 0;
+        }
+        xputs(path, plen);
+        xendword(xpand.len - plen);
+        return 1;
+    }
+
+    path[plen] = '\0';
+    if(!(dc = dirlist(path))){
+        return 0;
+    }
+    lit = strcspn(comp, "*?[\\");                                                         //Only names starting with the
+    i = dirfirst(dc, comp, lit);                                                            //literal prefix can match
+
+    if(!rest){                                                                              //Last component: add the matches
+        for(; i < dc->n && !strncmp(dc->names + dc->off[i], comp, lit); i++){
+            name = dc->names + dc->off[i];
+            nlen = strlen(name);
+            if(plen + nlen + 2 > PATH_MAX || fnmatch(comp, name, FNM_PERIOD)){
+                continue;
+            }
+            memcpy(path + plen, name, nlen);
+            if(slash){                                                                      //Only directories match a/
+                path[plen + nlen] = '\0';
+                if(stat(path, &st) < 0 || !S_ISDIR(st.st_mode)){
+                    continue;
+                }
+                path[plen + nlen++] = '/';
+            }
+            xputs(path, plen + nlen);
+            xendword(xpand.len - plen - nlen);
+            n++;
+        }
+        return n;
+    }
+
+    if(!(names = malloc(dc->len + 1))){                                                     //Descending may evict this
+        app_error("expand: out of memory");                                                 //listing, so keep the matches
+    }
+    for(len = 0; i < dc->n && !strncmp(dc->names + dc->off[i], comp, lit); i++){
+        name = dc->names + dc->off[i];
+        if(!fnmatch(comp, name, FNM_PERIOD)){
+            nlen = strlen(name) + 1;
+            memcpy(names + len, name, nlen);
+            len += nlen;
+        }
+    }
+    for(name = names; name < names + len; name += nlen + 1){                                //Match the rest below each
+        nlen = strlen(name);
+        if(plen + nlen + 2 > PATH_MAX){
+            continue;
+        }
+        memcpy(path + plen, name, nlen);
+        path[plen + nlen] = '/';
+        n += globpath(path, plen + nlen + 1, rest);
+    }
+    free(names);
+    return n;
+}
+
+/**
+ * @brief lookupvar Return the value of the variable named by name[0..len)
+ * @return The value, NULL if the variable is unset
+ */
+char *lookupvar(const char *name, size_t len){
+    static char status[16];
+    struct var_t *v;
+
+    if(len == 1 && *name == '?'){                                                           //$? is the last exit status
+        sprintf(status, "%d", laststatus);
+        return status;
+    }
+    v = findvar(name, len);
+    return v ? v->entry + len + 1 : NULL;                                                   //The value follows "NAME="
+}
+
+/**
+ * @brief expandargs Expand $NAME, ${NAME}, $? and glob patterns in the
+ *     words of argv, leaving characters quoted with a backslash alone,
+ *     then drop those backslashes. Leading NAME=value words are counted
+ *     in xpand.nassign, and only have their variables expanded. Words
+ *     with nothing to expand are used where they are.
+ * @param argv The words of a command
+ * @param argtype The type of each word, from parseline()
+ * @return The expanded words, valid until the next call
+ */
+char **expandargs(char **argv, int *argtype){
+    char path[PATH_MAX];
+    char *p, *q, *end, *val;
+    size_t start, i;
+    int dollar, matched, assign, brace;
+
+    xpand.len = xpand.argc = xpand.nassign = 0;
+    for(i = 0; argv[i]; i++){
+        start = xpand.len;
+        assign = xpand.argc == xpand.nassign && isassign(argv[i]);                         //Still in the leading NAME=value words
+        if(argtype[i] == ARGQUOTED || argtype[i] == ARGAMP){                                //Nothing to expand
+            xaddword(argv[i]);
+            xpand.nassign += assign;
+            continue;
+        }
+
+        dollar = 0;
+        for(p = argv[i]; *p; p = end){                                                      //Substitute variables
+            end = p + strcspn(p, "$\\");
+            xputs(p, end - p);
+            if(!*end){
+                break;
+            }
+            if(*end == '\\'){                                                              //Keep \c for globbing
+                xputs(end, end[1] ? 2 : 1);
+                end += end[1] ? 2 : 1;
+                continue;
+            }
+
+            p = end + 1;
+            brace = 0;
+            if(*p == '{' && (end = strchr(p, '}'))){                                        //${NAME}
+                if(end == p + 1){                                                           //${} stays as typed
+                    xputs("${}", 3);
+                    end++;
+                    continue;
+                }
+                p++;
+                brace = 1;
+            }
+            else if(*p == '?'){                                                             //$?
+                end = p + 1;
+            }
+            else{                                                                           //$NAME
+                for(end = p; isalnum((unsigned char)*end) || *end == '_'; end++)
+                    ;
+            }
+            if(end == p){                                                                   //A lone '$' stays
+                xputs("$", 1);
+                continue;
+            }
+            if((val = lookupvar(p, end - p))){                                              //Unset expands to nothing
+                for(; (q = strchr(val, '\\')); val = q + 1){                                //so a \ in the value stays one
+                    xputs(val, q - val + 1);
+                    xputs("\\", 1);
+                }
+                xputs(val, strlen(val));
+            }
+            dollar = 1;
+            end += brace;                                                                   //Past the closing '}'
+        }
+
+        if(assign){                                                                         //Assignments aren't globbed
+            xpand.len = start + xunescape(xpand.buf + start, xpand.len - start);
+            xendword(start);
+            xpand.nassign++;
+            continue;
+        }
+        if(dollar && xpand.len == start && argtype[i] != ARGQWORD){                         //Expanded to nothing: drop it,
+            continue;                                                                       //unless it was quoted
+        }
+
+        xputs("", 1);                                                                       //Terminate it for hasglob()
+        xpand.len--;
+        if(hasglob(xpand.buf + start) && xpand.len - start < PATH_MAX){                     //Glob the word
+            char pat[PATH_MAX];
+            memcpy(pat, xpand.buf + start, xpand.len - start + 1);
+            xpand.len = start;
+            if(pat[0] == '/'){
+                path[0] = '/';
+                matched = globpath(path, 1, pat + 1);
+            }
+            else{
+                matched = globpath(path, 0, pat);
+            }
+            if(matched){
+                continue;
+            }
+            xputs(pat, strlen(pat));                                                        //No match leaves it alone
+        }
+        xpand.len = start + xunescape(xpand.buf + start, xpand.len - start);
+        xendword(start);
+    }
+
+    for(i = 0; i < xpand.argc; i++){                                                        //The buffer is settled now
+        if(xpand.off[i] != XINPLACE){
+            xpand.argv[i] = xpand.buf + xpand.off[i];
+        }
+    }
+    if(!xpand.argv && !(xpand.argv = malloc(sizeof(char *)))){
+        app_error("expand: out of memory");
+    }
+    xpand.argv[xpand.argc] = NULL;
+    return xpand.argv;
+}
+/*****************************************************
+ * end helper routines for variable and glob expansion
+ *****************************************************/
+
+
+/*******************************************
+ * Helper routines for the shell variables
+ *******************************************/
+
+/*
+ * Variables live in a chained hash table, each as one "NAME=value"
+ * string so that exported ones can go into an environment as they are.
+ * envp is the environment handed to every job. It is rebuilt only after
+ * a variable is added, removed or exported. A new value for a variable
+ * already in envp just replaces its slot. envp keeps spare slots at
+ * the end, so a forked child can apply its NAME=value overrides in
+ * place without copying the environment.
+ */
+
+/**
+ * @brief varhash Hash the variable name name[0..len)
+ */
+unsigned int varhash(const char *name, size_t len){
+    return fnvhash(name, len) % VARBUCKETS;
+}
+
+/**
+ * @brief findvar Find the variable named by name[0..len)
+ * @return The variable, NULL if it is unset
+ */
+struct var_t *findvar(const char *name, size_t len){
+    struct var_t *v;
+
+    for(v = vars[varhash(name, len)]; v; v = v->next){
+        if(v->namelen == len && !memcmp(v->entry, name, len)){
+            return v;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief varname Return the length of the variable name word starts with
+ */
+size_t varname(const char *word){
+    const char *p = word;
+
+    if(!isalpha((unsigned char)*p) && *p != '_'){                                           //Names can't start with a digit
+        return 0;
+    }
+    while(isalnum((unsigned char)*p) || *p == '_'){
+        p++;
+    }
+    return p - word;
+}
+
+/**
+ * @brief isassign Return the length of NAME if word is NAME=value, else 0
+ */
+size_t isassign(const char *word){
+    size_t len = varname(word);
+
+    return len && word[len] == '=' ? len : 0;
+}
+
+/**
+ * @brief setvar Set a variable, creating it if need be
+ * @param entry The variable as "NAME=value"
+ * @param namelen The length of NAME
+ * @param export 1 to export the variable, 0 to leave that as it was
+ */
+void setvar(const char *entry, size_t namelen, int export){
+    struct var_t *v = findvar(entry, namelen);
+    unsigned int h;
+    char *copy;
+
+    if(!(copy = strdup(entry))){
+        app_error("variables: out of memory");
+    }
+
+    if(!v){                                                                                 //A new variable
+        if(!(v = malloc(sizeof(*v)))){
+            app_error("variables: out of memory");
+        }
+        h = varhash(entry, namelen);
+        v->next = vars[h];
+        vars[h] = v;
+        v->namelen = namelen;
+        v->exported = 0;
+        v->entry = NULL;
+    }
+    free(v->entry);
+    v->entry = copy;
+
+    if(export && !v->exported){                                                             //Joins the environment
+        v->exported = 1;
+        envdirty = 1;
+    }
+    else if(v->exported && !envdirty){                                                      //Already in envp: swap it in
+        envp[v->envidx] = v->entry;
+    }
+}
+
+/**
+ * @brief unsetvar Remove the variable named by name[0..len), if set
+ */
+void unsetvar(const char *name, size_t len){
+    struct var_t **vp, *v;
+
+    for(vp = &vars[varhash(name, len)]; (v = *vp); vp = &v->next){
+        if(v->namelen == len && !memcmp(v->entry, name, len)){
+            *vp = v->next;
+            if(v->exported){
+                envdirty = 1;
+            }
+            free(v->entry);
+            free(v);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief initvars Import the shell's own environment as exported variables
+ */
+void initvars(void){
+    char **ep;
+    size_t len;
+
+    for(ep = environ; *ep; ep++){
+        if((len = isassign(*ep))){
+            setvar(*ep, len, 1);
+        }
+    }
+}
+
+/**
+ * @brief envsync Bring envp up to date with the variables
+ * @param spare Slots to keep free after the last variable
+ * @return The environment for execve()
+ */
+char **envsync(size_t spare){
+    struct var_t *v;
+    size_t i, n = 0;
+
+    if(envdirty){                                                                           //Count what goes in
+        for(i = 0; i < VARBUCKETS; i++){
+            for(v = vars[i]; v; v = v->next){
+                n += v->exported;
+            }
+        }
+    }
+    else{
+        n = envc;
+    }
+
+    if(n + spare + 1 > envcap){                                                             //Make room, spare slots too
+        envcap = n + spare + 1 + ENVSPARE;
+        if(!(envp = realloc(envp, envcap * sizeof(char *)))){
+            app_error("variables: out of memory");
+        }
+        envdirty = 1;
+    }
+
+    if(envdirty){                                                                           //Rebuild it
+        envc = 0;
+        for(i = 0; i < VARBUCKETS; i++){
+            for(v = vars[i]; v; v = v->next){
+                if(v->exported){
+                    v->envidx = envc;
+                    envp[envc++] = v->entry;
+                }
+            }
+        }
+        envp[envc] = NULL;
+        envdirty = 0;
+    }
+    return envp;
+}
+
+/**
+ * @brief envoverride Apply NAME=value overrides to envp in a forked child
+ * @param assign The overrides, from envsync(n)'s caller
+ * @param n The number of overrides
+ */
+void envoverride(char **assign, size_t n){
+    struct var_t *v;
+    size_t i, j, len, base = envc;
+
+    for(i = 0; i < n; i++){
+        len = isassign(assign[i]);
+        if((v = findvar(assign[i], len)) && v->exported){                                  //Replace the inherited value
+            envp[v->envidx] = assign[i];
+            continue;
+        }
+        for(j = base; j < envc && strncmp(envp[j], assign[i], len + 1); j++)                //or an earlier override
+            ;
+        envp[j] = assign[i];
+        if(j == envc){                                                                      //or use a spare slot
+            envp[++envc] = NULL;
+        }
+    }
+}
+
+/**
+ * @brief envsort qsort comparator for "NAME=value" strings
+ */
+int envsort(const void *a, const void *b){
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/*****************************************
+ * end helper routines for the variables
+ *****************************************/
+
+
+/*****************************************
+ * Helper routines for the result cache
+ *****************************************/
+
+/*
+ * "cached [-e name] [-i file] [-m file] [--] command [args ...]" runs a
+ * deterministic command at most once per set of inputs. The key is a
+ * 128-bit FNV-1a hash of the working directory, the NAME=value words
+ * before the prefix, the command's arguments, the resolved binary (its
+ * path, inode, size and mtime), the value of each -e variable, the
+ * content of each -i file and the size and mtime of each -m file.
+ *
+ * The store is the directory $TSH_CACHE ($HOME/.tshcache by default),
+ * with one file per result, named by the key in hex: a cachehdr_t,
+ * then the command's stdout, then its stderr. A hit replays them and
+ * sets the status without forking. On a miss the forked child becomes
+ * a tee: it runs the command as its own child, passes its stdout and
+ * stderr on as they come, copies them to temporary files and exits
+ * the way the command did. Once the tee is reaped, advancejobs() makes
+ * the files into an entry. Commands that are killed or can't be run
+ * are not recorded. When the command stops, the tee stops with the
+ * same signal, which is what the shell sees, and passes the SIGCONT
+ * that resumes it on. The command is in the job's process group but
+ * doesn't lead it, so one that signals the group named by its own pid,
+ * as mystop does, finds no such group.
+ *
+ * The store is kept below $TSH_CACHEMAX bytes (a k, m or g suffix may
+ * follow, CACHEMAX by default). A hit touches its entry's mtime, and
+ * once the store grows past the limit the least recently used entries
+ * are removed until it is down to three quarters of it. Digests of -i
+ * files are remembered by path while the file's inode, size and mtime
+ * stay the same, with the same care for racy timestamps as dircache.
+ */
+
+/**
+ * @brief cachehash Add len bytes of data to a 128-bit FNV-1a hash,
+ *     taking a word at a time where the bytes allow
+ * @return The new hash
+ */
+unsigned __int128 cachehash(unsigned __int128 h, const void *data, size_t len){
+    const unsigned __int128 prime = ((unsigned __int128)1 << 88) + 0x13b;
+    const unsigned char *p = data;
+    uint64_t w;
+
+    for(; len >= sizeof(w); p += sizeof(w), len -= sizeof(w)){                              //Eight bytes per multiply
+        memcpy(&w, p, sizeof(w));
+        h = (h ^ w) * prime;
+    }
+    for(; len > 0; len--){
+        h = (h ^ *p++) * prime;
+    }
+    return h;
+}
+
+/**
+ * @brief cachefile Get the digest of a file's content
+ * @param path The file
+ * @param digest Set to the digest
+ * @return 1 if the file could be read, 0 if not
+ */
+int cachefile(const char *path, unsigned __int128 *digest){
+    static char buf[65536];
+    struct cachefile_t *cf;
+    unsigned __int128 d = CACHEBASIS;
+    struct stat st;
+    ssize_t n;
+    int fd;
+
+    cf = &cache.file[fnvhash(path, strlen(path)) % CACHEFILES];
+
+    if(stat(path, &st) < 0 || !S_ISREG(st.st_mode)){
+        return 0;
+    }
+    if(cf->path && !strcmp(cf->path, path) && !cf->racy &&                                  //Same file, unchanged
+       cf->dev == st.st_dev && cf->ino == st.st_ino && cf->size == st.st_size &&
+       cf->mtime.tv_sec == st.st_mtim.tv_sec && cf->mtime.tv_nsec == st.st_mtim.tv_nsec){
+        *digest = cf->digest;
+        return 1;
+    }
+
+    if((fd = open(path, O_RDONLY|O_CLOEXEC)) < 0){
+        return 0;
+    }
+    while((n = read(fd, buf, sizeof(buf))) > 0){
+        d = cachehash(d, buf, n);
+    }
+    close(fd);
+    if(n < 0){
+        return 0;
+    }
+
+    if(!cf->path || strcmp(cf->path, path)){                                                //Take over the slot
+        free(cf->path);
+        if(!(cf->path = strdup(path))){
+            app_error("cached: out of memory");
+        }
+    }
+    cf->dev = st.st_dev;
+    cf->ino = st.st_ino;
+    cf->size = st.st_size;
+    cf->mtime = st.st_mtim;
+    cf->racy = racy(&st);
+    cf->digest = d;
+    *digest = d;
+    return 1;
+}
+
+/**
+ * @brief cachestat Add the identity of a file (inode, size and mtime) to a hash
+ * @return The new hash
+ */
+unsigned __int128 cachestat(unsigned __int128 h, const struct stat *st){
+    uint64_t id[5];
+
+    id[0] = st->st_dev;
+    id[1] = st->st_ino;
+    id[2] = st->st_size;
+    id[3] = st->st_mtim.tv_sec;
+    id[4] = st->st_mtim.tv_nsec;
+    return cachehash(h, id, sizeof(id));
+}
+
+/**
+ * @brief cachedir Find the store, creating it if need be
+ * @return The store directory, or NULL if it can't be used
+ */
+char *cachedir(void){
+    char *dir = lookupvar("TSH_CACHE", 9), *home;
+
+    if(!dir || !*dir){                                                                      //The default store
+        home = lookupvar("HOME", 4);
+        snprintf(sbuf, sizeof(sbuf), "%s/.tshcache", home ? home : ".");
+        dir = sbuf;
+    }
+    if(cache.dir && !strcmp(cache.dir, dir)){                                               //The store we know
+        return cache.dir;
+    }
+
+    if(mkdir(dir, 0700) < 0 && errno != EEXIST){
+        printf("cached: can't create %s: %s\n", dir, strerror(errno));
+        return NULL;
+    }
+    free(cache.dir);
+    if(!(cache.dir = strdup(dir))){
+        app_error("cached: out of memory");
+    }
+    cache.total = -1;                                                                       //Size it up on the next record
+    return cache.dir;
+}
+
+/**
+ * @brief cachemax The most bytes the store may hold: $TSH_CACHEMAX or CACHEMAX
+ */
+long long cachemax(void){
+    char *val = lookupvar("TSH_CACHEMAX", 12), *end;
+    long long max;
+
+    if(!val || (max = strtoll(val, &end, 10)) <= 0){
+        return CACHEMAX;
+    }
+    switch(tolower(*end)){
+    case 'g':
+        max <<= 10;                                                                         //fall through
+    case 'm':
+        max <<= 10;                                                                         //fall through
+    case 'k':
+        max <<= 10;
+    }
+    return max;
+}
+
+/**
+ * @brief cachecopy Copy len bytes at offset off of one file to another descriptor
+ * @return 1 if all of them were written, 0 if not
+ */
+int cachecopy(int from, off_t off, uint64_t len, int to){
+    static char buf[65536];
+    ssize_t n, done, w;
+
+    while(len > 0){
+        if((n = pread(from, buf, len < sizeof(buf) ? len : sizeof(buf), off)) <= 0){
+            return 0;
+        }
+        for(done = 0; done < n; done += w){                                                 //Writes to a pipe may be short
+            if((w = write(to, buf + done, n - done)) < 0){
+                return 0;
+            }
+        }
+        off += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/**
+ * @brief cachebegin Look up the result of a cached command. A hit is
+ *     replayed on the spot. On a miss, files to record the command's
+ *     output in are set up for the fork to come.
+ * @param argv The expanded words, "cached" following nassign NAME=value words
+ * @param nassign The number of NAME=value words
+ * @param status Set to the stored exit status on a hit
+ * @return The index in argv of the command to run, or 0 if there is none
+ */
+size_t cachebegin(char **argv, size_t nassign, int *status){
+    unsigned __int128 h = CACHEBASIS, d;
+    struct cachehdr_t hdr;
+    struct cacherun_t *r = NULL;
+    char path[PATH_MAX], *dir;
+    struct stat st;
+    size_t i, cmd;
+    char *val;
+    int fd;
+
+    for(cmd = nassign + 1; argv[cmd] && argv[cmd][0] == '-'; cmd += 2){                     //Skip the options
+        if(!strcmp(argv[cmd], "--")){
+            cmd++;
+            break;
+        }
+        if(strlen(argv[cmd]) != 2 || !strchr("eim", argv[cmd][1]) || !argv[cmd + 1]){
+            break;
+        }
+    }
+    if(!argv[cmd] || argv[cmd][0] == '-'){                                                  //If no command
+        printf("cached: usage: cached [-e name] [-i file] [-m file] [--] command [args ...]\n");
+        *status = 2;
+        return 0;
+    }
+
+    if(stat(argv[cmd], &st) < 0 || !S_ISREG(st.st_mode) ||                                  //Not a program: run it as usual
+       !realpath(argv[cmd], path) || !(dir = cachedir())){
+        return cmd;
+    }
+
+    h = cachehash(h, path, strlen(path) + 1);                                               //The resolved binary
+    h = cachestat(h, &st);
+    if(getcwd(path, sizeof(path))){                                                         //where it runs
+        h = cachehash(h, path, strlen(path) + 1);
+    }
+    for(i = 0; i < nassign; i++){                                                           //its NAME=value overrides
+        h = cachehash(h, argv[i], strlen(argv[i]) + 1);
+    }
+    for(i = cmd; argv[i]; i++){                                                             //and arguments
+        h = cachehash(h, argv[i], strlen(argv[i]) + 1);
+    }
+    for(i = nassign + 1; i < cmd && strcmp(argv[i], "--"); i += 2){                         //then the declared inputs
+        h = cachehash(h, argv[i], 3);                                                       //each tagged with its option
+        h = cachehash(h, argv[i + 1], strlen(argv[i + 1]) + 1);
+        if(argv[i][1] == 'e' && (val = lookupvar(argv[i + 1], strlen(argv[i + 1])))){
+            h = cachehash(h, val, strlen(val) + 1);
+        }
+        else if(argv[i][1] == 'i' && cachefile(argv[i + 1], &d)){
+            h = cachehash(h, &d, sizeof(d));
+        }
+        else if(argv[i][1] == 'm' && stat(argv[i + 1], &st) == 0){
+            h = cachestat(h, &st);
+        }
+        else{
+            h = cachehash(h, "", 1);                                                        //Unset or missing
+        }
+    }
+    snprintf(path, sizeof(path), "%s/%016llx%016llx", dir,
+             (unsigned long long)(h >> 64), (unsigned long long)h);
+
+    if((fd = open(path, O_RDONLY|O_CLOEXEC)) >= 0){                                         //A hit, unless it's damaged
+        if(pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.magic == CACHEMAGIC &&
+           fstat(fd, &st) == 0 && st.st_size == sizeof(hdr) + hdr.outlen + hdr.errlen){
+            futimens(fd, NULL);                                                             //Recently used
+            fflush(stdout);
+            cachecopy(fd, sizeof(hdr), hdr.outlen, STDOUT_FILENO);
+            cachecopy(fd, sizeof(hdr) + hdr.outlen, hdr.errlen, STDERR_FILENO);
+            close(fd);
+            if(verbose){
+                printf("cached: hit %s\n", path);
+            }
+            *status = hdr.status;
+            return 0;
+        }
+        close(fd);
+        unlink(path);
+    }
+
+    for(i = 0; i < MAXJOBS && !r; i++){                                                     //A miss: find a free slot
+        r = cache.run[i].pid ? NULL : &cache.run[i];
+    }
+    if(!r || !(r->path = strdup(path))){                                                    //or run it unrecorded
+        return cmd;
+    }
+    snprintf(path, sizeof(path), "%s.%d.%lu", r->path, (int)getpid(), cache.seq++);         //Temporary names, unique to us
+    if(!(r->tmp = malloc(strlen(path) + 5))){
+        app_error("cached: out of memory");
+    }
+    sprintf(r->tmp, "%s.out", path);
+    r->outfd = open(r->tmp, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    sprintf(r->tmp, "%s.err", path);
+    r->errfd = open(r->tmp, O_RDWR|O_CREAT|O_EXCL|O_CLOEXEC, 0600);
+    unlink(r->tmp);                                                                         //stderr needs no name
+    sprintf(r->tmp, "%s.out", path);
+    if(r->outfd < 0 || r->errfd < 0 || lseek(r->outfd, sizeof(hdr), SEEK_SET) < 0){         //stdout goes after the header
+        printf("cached: can't record in %s: %s\n", cache.dir, strerror(errno));
+        cachedrop(r);
+        return cmd;
+    }
+    cache.next = r;
+    return cmd;
+}
+
+/**
+ * @brief cachetee In the child forked for a cached command, start the
+ *     command in a child of its own, with its stdout and stderr going
+ *     through pipes, and return in that child. The forked child stays
+ *     behind as the tee, in the job's process group: it passes both on
+ *     and into the recording's files until the command is done, then
+ *     exits with its status or dies of its signal. Keyboard signals
+ *     reach the command and are left to it, and its stops are passed
+ *     on by cachetwait().
+ * @param r The recording set up by cachebegin()
+ */
+void cachetee(struct cacherun_t *r){
+    static char buf[65536];
+    struct pollfd fds[2];                                                                   //The command's stdout and stderr
+    int out[2], err[2], to[2], rec[2];
+    int i, live, status, done;
+    sigset_t chld, wait;
+    pid_t pid;
+    ssize_t n;
+
+    if(pipe(out) < 0 || pipe(err) < 0 || (pid = fork()) < 0){                               //Run it unrecorded, then
+        return;
+    }
+    if(pid == 0){                                                                           //The command
+        dup2(out[1], STDOUT_FILENO);
+        dup2(err[1], STDERR_FILENO);
+        close(out[0]);
+        close(out[1]);
+        close(err[0]);
+        close(err[1]);
+        return;
+    }
+
+    Signal(SIGCHLD, cachetchld);                                                            //Not the shell's handlers
+    Signal(SIGTSTP, SIG_DFL);
+    Signal(SIGINT, SIG_IGN);
+    Signal(SIGQUIT, SIG_IGN);
+    close(out[1]);
+    close(err[1]);
+    fds[0].fd = out[0];
+    fds[1].fd = err[0];
+    to[0] = STDOUT_FILENO;
+    to[1] = STDERR_FILENO;
+    rec[0] = r->outfd;
+    rec[1] = r->errfd;
+    Sigemptyset(&chld);
+    Sigaddset(&chld, SIGCHLD);
+    Sigprocmask(SIG_BLOCK, &chld, &wait);                                                   //Only let it in while polling
+    for(live = 2, done = 0; live > 0; ){
+        if(!done){
+            done = cachetwait(pid, &status, WNOHANG);                                       //It may have stopped
+        }
+        fds[0].events = fds[1].events = POLLIN;
+        if(ppoll(fds, 2, NULL, &wait) < 0){
+            if(errno == EINTR){
+                continue;
+            }
+            break;
+        }
+        for(i = 0; i < 2; i++){
+            if(!fds[i].revents){
+                continue;
+            }
+            if((n = read(fds[i].fd, buf, sizeof(buf))) <= 0){                               //That one is closed
+                if(n < 0 && errno == EINTR){
+                    continue;
+                }
+                fds[i].fd = -1;
+                live--;
+                continue;
+            }
+            cachewrite(to[i], buf, n);                                                      //Shown as it comes
+            if(rec[0] >= 0 && !cachewrite(rec[i], buf, n)){                                 //and recorded, until a write
+                unlink(r->tmp);                                                             //fails: then not at all
+                rec[0] = rec[1] = -1;
+            }
+        }
+    }
+
+    while(!done){                                                                           //Its output is closed, but it
+        done = cachetwait(pid, &status, 0);                                                 //may still stop before it exits
+    }
+    if(WIFSIGNALED(status)){                                                                //Die the same way
+        signal(WTERMSIG(status), SIG_DFL);
+        kill(getpid(), WTERMSIG(status));
+    }
+    _exit(WIFEXITED(status) ? WEXITSTATUS(status) : 127);
+}
+
+/**
+ * @brief cachetwait In the tee, collect a change in the state of the
+ *     command. If it stopped, stop the tee with the same signal, so
+ *     the job stops, and resume the command when the tee is resumed.
+ * @param pid The command
+ * @param status Set to the command's wait status
+ * @param flags WNOHANG, or 0 to wait for a change
+ * @return 1 once the command is done, 0 if not
+ */
+int cachetwait(pid_t pid, int *status, int flags){
+    pid_t w;
+
+    while((w = waitpid(pid, status, flags | WUNTRACED)) < 0 && errno == EINTR)
+        ;
+    if(w < 0){                                                                              //Can't happen, but don't record it
+        *status = W_EXITCODE(127, 0);
+        return 1;
+    }
+    if(w == pid && WIFSTOPPED(*status)){
+        kill(getpid(), WSTOPSIG(*status));                                                  //Stop here, until the job
+        kill(pid, SIGCONT);                                                                 //is resumed
+        return 0;
+    }
+    return w == pid;
+}
+
+/**
+ * @brief cachetchld In the tee, only interrupt ppoll() when the command
+ *     stops or exits, see cachetwait()
+ */
+void cachetchld(int sig){
+    (void)sig;
+}
+
+/**
+ * @brief cachewrite Write all of buf to a descriptor
+ * @return 1 if all of it was written, 0 if not
+ */
+int cachewrite(int fd, const char *buf, size_t len){
+    ssize_t w;
+
+    for(; len > 0; buf += w, len -= w){                                                     //Writes to a pipe may be short
+        if((w = write(fd, buf, len)) < 0){
+            if(errno == EINTR){
+                w = 0;
+                continue;
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief cacheforked Hand the recording set up by cachebegin() to the
+ *     forked command, or drop it if nothing was forked
+ * @param pid The command's process, or 0
+ */
+void cacheforked(pid_t pid){
+    if(!cache.next){
+        return;
+    }
+    if(pid){
+        cache.next->pid = pid;
+    }
+    else{
+        cachedrop(cache.next);
+    }
+    cache.next = NULL;
+}
+
+/**
+ * @brief cachereaped Note that the tee of a cached command was reaped.
+ *     Called from sigchld_handler, so the recording is left to
+ *     cachedone().
+ * @param pid The process reaped
+ * @param status Its wait status
+ */
+void cachereaped(pid_t pid, int status){
+    int i;
+
+    for(i = 0; i < MAXJOBS; i++){
+        if(cache.run[i].pid == pid){
+            cache.run[i].status = status;
+            cache.run[i].reaped = 1;
+            return;
+        }
+    }
+}
+
+/**
+ * @brief cachedone Make the output of each cached command that was
+ *     reaped into an entry, if it ran to the end and fits in the store
+ */
+void cachedone(void){
+    struct cacherun_t *r;
+    struct cachehdr_t hdr;
+    struct stat st;
+    long long max;
+    int i;
+
+    for(i = 0; i < MAXJOBS; i++){
+        r = &cache.run[i];
+        if(!r->pid || !r->reaped){                                                          //Free, or still running
+            continue;
+        }
+
+        fstat(r->outfd, &st);
+        hdr.magic = CACHEMAGIC;
+        hdr.status = WIFEXITED(r->status) ? WEXITSTATUS(r->status) : 128 + WTERMSIG(r->status);
+        hdr.outlen = st.st_size > sizeof(hdr) ? st.st_size - sizeof(hdr) : 0;
+        fstat(r->errfd, &st);
+        hdr.errlen = st.st_size;
+
+        max = cachemax();
+        if(WIFEXITED(r->status) && hdr.status != 127 &&                                     //Ran to the end
+           sizeof(hdr) + hdr.outlen + hdr.errlen <= max &&                                 //and fits in the store
+           cachecopy(r->errfd, 0, hdr.errlen, r->outfd) &&                                  //stderr goes after stdout
+           pwrite(r->outfd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+           rename(r->tmp, r->path) == 0){
+            free(r->tmp);
+            r->tmp = NULL;                                                                  //Nothing left to remove
+            if(cache.total < 0 || (cache.total += sizeof(hdr) + hdr.outlen + hdr.errlen) > max){
+                cacheevict(max);
+            }
+        }
+        cachedrop(r);
+    }
+}
+
+/**
+ * @brief cachedrop Free a recording slot, removing its temporary file
+ */
+void cachedrop(struct cacherun_t *r){
+    if(r->outfd >= 0){
+        close(r->outfd);
+    }
+    if(r->errfd >= 0){
+        close(r->errfd);
+    }
+    if(r->tmp){
+        unlink(r->tmp);
+    }
+    free(r->tmp);
+    free(r->path);
+    r->pid = r->reaped = 0;
+    r->outfd = r->errfd = -1;
+    r->tmp = r->path = NULL;
+}
+
+/**
+ * @brief cacheevict Size up the store, and if it holds more than max
+ *     bytes remove the least recently used entries until it is down to
+ *     three quarters of that. Temporary files left by shells that died
+ *     go too, once they are CACHESTALE seconds old.
+ */
+void cacheevict(long long max){
+    struct { struct timespec mtime; off_t size; char name[33]; } *ent = NULL, *e;
+    size_t n = 0, cap = 0, i;
+    time_t now = time(NULL);
+    struct dirent *de;
+    struct stat st;
+    long long total = 0;
+    DIR *dp;
+
+    if(!(dp = opendir(cache.dir))){
+        return;
+    }
+    while((de = readdir(dp))){
+        if(fstatat(dirfd(dp), de->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)){
+            continue;
+        }
+        if(strlen(de->d_name) != 32 || de->d_name[strspn(de->d_name, "0123456789abcdef")]){ //Not an entry
+            if(st.st_mtime < now - CACHESTALE){
+                unlinkat(dirfd(dp), de->d_name, 0);
+            }
+            continue;
+        }
+        if(n == cap){                                                                       //Grow the entry list
+            cap = cap ? 2 * cap : 256;
+            if(!(ent = realloc(ent, cap * sizeof(*ent)))){
+                app_error("cached: out of memory");
+            }
+        }
+        e = &ent[n++];
+        e->mtime = st.st_mtim;
+        e->size = st.st_size;
+        strcpy(e->name, de->d_name);
+        total += st.st_size;
+    }
+
+    if(total > max){
+        qsort(ent, n, sizeof(*ent), cachesort);                                             //Least recently used first
+        for(i = 0; i < n && total > max - max / 4; i++){
+            if(unlinkat(dirfd(dp), ent[i].name, 0) == 0){
+                total -= ent[i].size;
+            }
+        }
+    }
+    closedir(dp);
+    free(ent);
+    cache.total = total;
+}
+
+/**
+ * @brief cachesort qsort comparator for cacheevict()'s entries: oldest mtime first
+ */
+int cachesort(const void *a, const void *b){
+    const struct timespec *x = a, *y = b;                                                   //mtime comes first in an entry
+
+    if(x->tv_sec != y->tv_sec){
+        return x->tv_sec < y->tv_sec ? -1 : 1;
+    }
+    return x->tv_nsec < y->tv_nsec ? -1 : (x->tv_nsec > y->tv_nsec);
+}
+
+/*****************************************
+ * end helper routines for the result cache
+ *****************************************/
+
+/*****************************************
+ * Helper routines for the job daemon
+ *****************************************/
+
+/*
+ * With -d <path> the shell serves job requests from local clients on a
+ * Unix-domain socket instead of reading commands from stdin. Requests
+ * and replies are single lines of text:
+ *
+ *     submit <cmdline>     run cmdline as a background job
+ *                          -> ok <jid> <pid>, or ok 0 0 if nothing forked
+ *     list                 -> job <jid> <pid> <state> <cmdline>
+ *                             for each job, then ok <count>, where
+ *                             state is running, stopped or waiting
+ *     signal <job> <sig>   send signal number sig to the job
+ *                          -> ok
+ *     status <job>         -> <state> <jid> <pid>, or
+ *                             done <pid> <status> once it finished
+ *     wait <job>           wait until the job is done
+ *                          -> done <pid> <status>
+ *     quit                 -> ok, and the daemon exits
+ *
+ * A job is named by %jid or by the pid that submit returned. Once it
+ * is gone both still name its result, %jid meaning the latest job that
+ * had that number, until DONELOG more jobs finish. Builtins such as fg
+ * or quit can't be submitted. A job submitted
+ * with "after" has no pid while it waits: submit returns ok <jid> 0,
+ * it is listed with pid 0, and it can't be signalled or waited for
+ * until it starts. Errors are replied
+ * as err <message>. A client may send requests without waiting for
+ * the replies, which come back in order; requests after a wait are
+ * held until the wait is answered.
+ *
+ * SIGCHLD is only unblocked inside ppoll(), so jobs are reaped and
+ * command lists advanced between requests, never during one.
+ */
+
+/**
+ * @brief jobdinit Start listening for job requests
+ * @param path The socket file, replaced if it exists
+ */
+void jobdinit(char *path){
+    struct sockaddr_un addr;
+    int i;
+
+    if(strlen(path) >= sizeof(addr.sun_path)){                                              //If the path doesn't fit
+        app_error("daemon: socket path too long");
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    if((jobd.fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0)) < 0){                       //Jobs mustn't inherit it
+        unix_error("daemon: socket error");
+    }
+    unlink(path);                                                                           //Left over from an earlier daemon
+    if(bind(jobd.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+        unix_error("daemon: bind error");
+    }
+    if(listen(jobd.fd, SOMAXCONN) < 0){
+        unix_error("daemon: listen error");
+    }
+    jobd.path = path;
+    jobd.pid = getpid();
+    atexit(jobdexit);                                                                       //Remove the socket on the way out
+
+    for(i = 0; i < MAXCLIENTS; i++){
+        jobd.client[i].fd = -1;
+    }
+}
+
+/**
+ * @brief jobdexit Remove the socket file when the daemon exits. Forked
+ *     jobs inherit the handler, and must leave the socket alone.
+ */
+void jobdexit(void){
+    if(getpid() == jobd.pid){
+        unlink(jobd.path);
+    }
+}
+
+/**
+ * @brief jobdserve Serve job requests until asked to quit
+ */
+void jobdserve(void){
+    struct pollfd fds[MAXCLIENTS + 1];                                                      //The socket, then each client
+    struct client_t *c;
+    sigset_t none, wait;                                                                    //The mask to wait with
+    int i, n;
+
+    Sigemptyset(&none);
+    Sigprocmask(SIG_BLOCK, &none, &wait);                                                   //Current mask, SIGCHLD included
+    sigdelset(&wait, SIGCHLD);                                                              //which is let in while idle
+
+    while(1){
+        advancejobs();                                                                      //Move on the jobs reaped in ppoll()
+        jobdwake();                                                                         //Answer waits for finished jobs
+        fflush(stdout);
+
+        fds[0].fd = jobd.fd;
+        fds[0].events = POLLIN;
+        for(i = 0, n = 1; i < MAXCLIENTS; i++){
+            c = &jobd.client[i];
+            if(c->fd >= 0){
+                fds[n].fd = c->fd;
+                fds[n++].events = c->wait ? 0 : POLLIN;                                     //A waiting client reads no more
+                c->pollidx = n - 1;
+            }
+        }
+
+        if(ppoll(fds, n, NULL, &wait) < 0){                                                 //Reap only in here
+            if(errno == EINTR){
+                continue;
+            }
+            unix_error("daemon: ppoll error");
+        }
+
+        if(fds[0].revents & POLLIN){                                                        //A new client
+            jobdaccept();
+        }
+        for(i = 0; i < MAXCLIENTS; i++){
+            c = &jobd.client[i];
+            if(c->fd >= 0 && c->pollidx < n && fds[c->pollidx].revents){
+                jobdread(c);
+            }
+        }
+    }
+}
+
+/**
+ * @brief jobdaccept Accept a connection, turning it away if all slots are taken
+ */
+void jobdaccept(void){
+    int fd, i;
+
+    if((fd = accept4(jobd.fd, NULL, NULL, SOCK_CLOEXEC)) < 0){
+        return;                                                                             //The client gave up already
+    }
+    for(i = 0; i < MAXCLIENTS; i++){
+        if(jobd.client[i].fd < 0){                                                          //A free slot
+            jobd.client[i].fd = fd;
+            jobd.client[i].len = jobd.client[i].cap = 0;
+            jobd.client[i].buf = NULL;
+            jobd.client[i].wait = 0;
+            jobd.client[i].pollidx = MAXCLIENTS + 1;                                        //Not polled yet
+            return;
+        }
+    }
+    jobdreply(fd, "err too many clients\n", 21);
+    close(fd);
+}
+
+/**
+ * @brief jobdclose Drop a client
+ */
+void jobdclose(struct client_t *c){
+    close(c->fd);
+    free(c->buf);
+    c->buf = NULL;
+    c->fd = -1;
+    c->wait = 0;
+}
+
+/**
+ * @brief jobdreply Send a reply to a client
+ * @return 0 if success, -1 if the client is gone
+ */
+int jobdreply(int fd, const char *buf, size_t len){
+    ssize_t n;
+
+    while(len > 0){
+        if((n = send(fd, buf, len, MSG_NOSIGNAL)) < 0){                                     //No SIGPIPE if it hung up
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/**
+ * @brief jobdread Read what a client sent and serve the complete requests
+ */
+void jobdread(struct client_t *c){
+    ssize_t n;
+
+    if(c->wait){                                                                            //Only a hangup wakes a waiting client
+        jobdclose(c);
+        return;
+    }
+    if(c->len == c->cap){                                                                   //Make room for more
+        if(c->cap > linemax + 16){                                                          //A request too long to ever end
+            jobdreply(c->fd, "err request too long\n", 21);
+            jobdclose(c);
+            return;
+        }
+        c->cap = c->cap ? 2 * c->cap : MAXLINE;
+        if(!(c->buf = realloc(c->buf, c->cap))){
+            app_error("daemon: out of memory");
+        }
+    }
+    if((n = recv(c->fd, c->buf + c->len, c->cap - c->len, 0)) <= 0){                       //End of file or error
+        jobdclose(c);
+        return;
+    }
+    c->len += n;
+    jobdrun(c);
+}
+
+/**
+ * @brief jobdrun Serve the complete requests buffered for a client, up
+ *     to the first wait that can't be answered yet
+ */
+void jobdrun(struct client_t *c){
+    char *line = c->buf, *nl;
+
+    while(c->fd >= 0 && !c->wait && (nl = memchr(line, '\n', c->len - (line - c->buf)))){
+        *nl = '\0';
+        jobdrequest(c, line);
+        line = nl + 1;
+    }
+    if(c->fd < 0){                                                                          //Dropped along the way
+        return;
+    }
+    c->len -= line - c->buf;                                                                //Keep the incomplete rest
+    memmove(c->buf, line, c->len);
+}
+
+/**
+ * @brief jobdrequest Serve one request from a client
+ * @param req The request, without its newline
+ */
+void jobdrequest(struct client_t *c, char *req){
+    static char *reply;                                                                     //Grown to fit the job list
+    static size_t cap;
+    size_t need = 256;
+    struct job_t *jd;
+    struct done_t *d;
+    char *arg;
+    int len = 0, n = 0, i, sig;
+
+    for(i = 0; i < MAXJOBS; i++){
+        if(jobs[i].jid != 0){
+            need += strlen(jobs[i].cmdline) + 64;
+        }
+    }
+    if(need > cap){
+        cap = need;
+        if(!(reply = realloc(reply, cap))){
+            app_error("daemon: out of memory");
+        }
+    }
+
+    if((arg = strchr(req, ' '))){                                                           //Split off the arguments
+        *arg++ = '\0';
+    }
+    else{
+        arg = req + strlen(req);
+    }
+
+    if(!strcmp(req, "submit")){
+        len = jobdsubmit(arg, reply);
+    }
+
+    else if(!strcmp(req, "list")){
+        for(i = 0; i < MAXJOBS; i++){
+            if(jobs[i].jid != 0){
+                len += sprintf(reply + len, "job %d %d %s %.*s\n", jobs[i].jid, jobs[i].leader,
+                               jobdstate(&jobs[i]),
+                               (int)strcspn(jobs[i].cmdline, "\n"), jobs[i].cmdline);
+                n++;
+            }
+        }
+        len += sprintf(reply + len, "ok %d\n", n);
+    }
+
+    else if(!strcmp(req, "signal")){
+        if(sscanf(arg, "%*s %d", &sig) != 1){
+            len = sprintf(reply, "err usage: signal <job> <sig>\n");
+        }
+        else if(!(jd = jobdfind(arg))){
+            len = sprintf(reply, "err %.64s: no such job\n", strtok(arg, " "));
+        }
+        else if(jd->state == WT){                                                           //No processes yet
+            len = sprintf(reply, "err job is waiting\n");
+        }
+        else if(kill(-jd->pid, sig) < 0){                                                   //Signal the job's process group
+            len = sprintf(reply, "err %s\n", strerror(errno));
+        }
+        else{
+            if(sig == SIGCONT && jd->state == ST){                                          //Resumed like bg
+                jd->state = BG;
+            }
+            len = sprintf(reply, "ok\n");
+        }
+    }
+
+    else if(!strcmp(req, "status") || !strcmp(req, "wait")){
+        if((jd = jobdfind(arg))){
+            if(req[0] == 's'){
+                len = sprintf(reply, "%s %d %d\n", jobdstate(jd), jd->jid, jd->leader);
+            }
+            else if(jd->state == WT){                                                       //No pid to wait by yet
+                len = sprintf(reply, "err job is waiting\n");
+            }
+            else{                                                                           //Answered by jobdwake()
+                c->wait = jd->leader;
+                return;
+            }
+        }
+        else if((d = arg[0] == '%' ? jobdstatus(0, atoi(arg + 1)) : jobdstatus(atoi(arg), 0))){  //Finished already
+            len = sprintf(reply, "done %d %d\n", d->leader, d->status);
+        }
+        else{
+            len = sprintf(reply, "err %.64s: no such job\n", arg);
+        }
+    }
+
+    else if(!strcmp(req, "quit")){
+        jobdreply(c->fd, "ok\n", 3);
+        exit(0);
+    }
+
+    else{
+        len = sprintf(reply, "err %.64s: unknown request\n", req);
+    }
+
+    if(jobdreply(c->fd, reply, len) < 0){                                                   //If the client is gone
+        jobdclose(c);
+    }
+}
+
+/**
+ * @brief jobdsubmit Start a submitted command line as a background job
+ * @param cmd The command line, without its newline
+ * @param reply Receives the reply
+ * @return The length of the reply
+ */
+int jobdsubmit(char *cmd, char *reply){
+    char *cmdline;
+    char **argv;                                                                            //arguments from parseline()
+    struct cmdlist_t list;                                                                  //the steps of the line
+    struct job_t *jd;
+    size_t len = strlen(cmd);
+    pid_t pid;
+    int i, n, jid;
+
+    for(i = 0; i < MAXJOBS && jobs[i].jid != 0; i++)                                        //Look for a free slot first,
+        ;                                                                                   //as a forked step needs one
+    if(i == MAXJOBS){
+        return sprintf(reply, "err job table full\n");
+    }
+    if(len > linemax){
+        return sprintf(reply, "err command too long\n");
+    }
+    if(!(cmdline = malloc(len + 2))){
+        app_error("daemon: out of memory");
+    }
+    memcpy(cmdline, cmd, len);                                                              //The job's text ends in a newline
+    strcpy(cmdline + len, "\n");
+
+    parseline(cmdline, &argv);                                                              //Always a background job
+    if(argv[0] == NULL){
+        n = sprintf(reply, cmd[strspn(cmd, " \t")] ? "err syntax error\n" : "err empty command\n");
+    }
+    else if(!parselist(&list, argv, tok.argtype, tok.first, tok.op)){
+        n = sprintf(reply, "err syntax error\n");
+    }
+    else if((i = jobdbuiltin(&list)) >= 0){
+        n = sprintf(reply, "err %.64s: builtins can't be submitted\n", list.argv[i]);
+    }
+    else if(jid = nextjid, !(pid = startjob(&list, BG, cmdline))){                          //No process: only builtins,
+        jd = getjobjid(jobs, jid);                                                          //or a job that waits
+        n = sprintf(reply, "ok %d 0\n", jd && jd->state == WT ? jid : 0);
+    }
+    else{
+        jd = getjobpid(jobs, pid);
+        n = sprintf(reply, "ok %d %d\n", jd ? jd->jid : 0, pid);
+    }
+    free(cmdline);
+    return n;
+}
+
+/**
+ * @brief jobdbuiltin Find a step of a submitted list that starts with a
+ *     builtin, past its NAME=value words. Builtins that only show up
+ *     once words are expanded are refused by runstep().
+ * @return The index in list->argv of the builtin, -1 if there is none
+ */
+int jobdbuiltin(struct cmdlist_t *list){
+    int i, w;
+
+    for(i = 0; i < list->nsteps; i++){
+        for(w = list->first[i]; list->argv[w] && isassign(list->argv[w]); w++)
+            ;
+        if(list->argv[w] && isbuiltin(list->argv[w])){
+            return w;
+        }
+    }
+    return -1;
+}
+
+/**
+ * @brief jobdfind Find the job a client named
+ * @param spec %jid, or the pid returned by submit
+ * @return The job, NULL if there is no such job right now
+ */
+struct job_t *jobdfind(const char *spec){
+    struct job_t *jd;
+    pid_t pid;
+
+    if(spec[0] == '%'){                                                                     //If % then job id
+        return isdigit((unsigned char)spec[1]) ? getjobjid(jobs, atoi(spec + 1)) : NULL;
+    }
+    if(!isdigit((unsigned char)spec[0])){
+        return NULL;
+    }
+    pid = atoi(spec);
+    return (jd = getjobleader(jobs, pid)) ? jd : getjobpid(jobs, pid);                      //By its first or its current pid
+}
+
+/**
+ * @brief jobdstate Name a job's state for list and status replies
+ */
+const char *jobdstate(struct job_t *job){
+    return job->state == ST ? "stopped" : (job->state == WT ? "waiting" : "running");
+}
+
+/**
+ * @brief jobdrecord Remember the status of a finished job for status and wait
+ */
+void jobdrecord(struct job_t *job){
+    struct done_t *d = &jobd.done[jobd.ndone++ % DONELOG];                                  //Overwrite the oldest
+
+    d->leader = job->leader;
+    d->jid = job->jid;
+    d->status = job->status;
+}
+
+/**
+ * @brief jobdstatus Look up a finished job
+ * @param pid The pid returned by submit, or 0 to look up by jid
+ * @param jid The job ID, the latest job that had it
+ * @return Its record, NULL if unknown or forgotten
+ */
+struct done_t *jobdstatus(pid_t pid, int jid){
+    struct done_t *d;
+    unsigned long i;
+
+    for(i = jobd.ndone; i > 0 && jobd.ndone - i < DONELOG; i--){                            //Newest first
+        d = &jobd.done[(i - 1) % DONELOG];
+        if(pid ? d->leader == pid : (jid > 0 && d->jid == jid)){
+            return d;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief jobdwake Answer the clients waiting for jobs that are now done
+ */
+void jobdwake(void){
+    struct client_t *c;
+    struct done_t *d;
+    char reply[64];
+    int i;
+
+    for(i = 0; i < MAXCLIENTS; i++){
+        c = &jobd.client[i];
+        if(c->fd < 0 || !c->wait || getjobleader(jobs, c->wait)){                           //Not waiting, or still running
+            continue;
+        }
+        if((d = jobdstatus(c->wait, 0))){
+            sprintf(reply, "done %d %d\n", c->wait, d->status);
+        }
+        else{
+            strcpy(reply, "err status forgotten\n");
+        }
+        c->wait = 0;
+        if(jobdreply(c->fd, reply, strlen(reply)) < 0){
+            jobdclose(c);
+            continue;
+        }
+        jobdrun(c);                                                                         //Requests held behind the wait
+    }
+}
+
+/*****************************************
+ * end helper routines for the job daemon
+ *****************************************/
+
+
+/***********************
+ * Other helper routines
+ ***********************/
+
+/*
+ * usage - print a help message
+ */
+void usage(void) 
+{
+    printf("Usage: shell [-hvpr] [-H file] [-d socket]\n");
+    printf("   -h   print this message\n");
+    printf("   -v   print additional diagnostic information\n");
+    printf("   -p   do not emit a command prompt\n");
+    printf("   -r   reap and account orphaned descendants of jobs\n");
+    printf("        (not those that leave the job's process group)\n");
+    printf("   -H   keep a persistent command history in <file>\n");
+    printf("   -d   serve job requests on the Unix socket <socket>\n");
+    exit(1);
+}
+
+/*
+ * unix_error - unix-style error routine
+ */
+void unix_error(char *msg)
+{
+    fprintf(stdout, "%s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+/*
+ * app_error - application-style error routine
+ */
+void app_error(char *msg)
+{
+    fprintf(stdout, "%s\n", msg);
+    exit(1);
+}
+
+/*
+ * Signal - wrapper for the sigaction function
+ */
+handler_t *Signal(int signum, handler_t *handler) 
+{
+    struct sigaction action, old_action;
+
+    action.sa_handler = handler;  
+    sigemptyset(&action.sa_mask); /* block sigs of type being handled */
+    action.sa_flags = SA_RESTART; /* restart syscalls if possible */
+
+    if (sigaction(signum, &action, &old_action) < 0)
+	unix_error("Signal error");
+    return (old_action.sa_handler);
+}
+
+/*
+ * sigquit_handler - The driver program can gracefully terminate the
+ *    child shell by sending it a SIGQUIT signal.
+ */
+void sigquit_handler(int sig) 
+{
+    printf("Terminating after receipt of SIGQUIT signal\n");
+    exit(1);
+}
+
+/**
+ * @brief reapchild Reap one waitable child, learning its process group first
+ * @param status Receives the wait status of the child
+ * @param pgid Receives the process group of the child, -1 if unknown
+ * @param ru Receives the resources used by the child
+ * @return The pid of the reaped child, 0 if none is ready, -1 if no children
+ */
+pid_t reapchild(int *status, pid_t *pgid, struct rusage *ru){
+    siginfo_t info;                                                                         //Details of the waitable child
+
+    info.si_pid = 0;                                                                        //Stays 0 if no child is ready
+    if(waitid(P_ALL, 0, &info, WEXITED|WSTOPPED|WNOHANG|WNOWAIT) < 0){                      //Peek without reaping
+        return -1;                                                                          //No children left
+    }
+    if(info.si_pid == 0){                                                                   //If no child changed state
+        return 0;
+    }
+
+    *pgid = getpgid(info.si_pid);                                                           //A zombie keeps its group until reaped
+    return wait4(info.si_pid, status, WNOHANG|WUNTRACED, ru);                               //Now reap it for real
+}
+
+/**
+ * @brief fnvhash 32-bit FNV-1a hash of s[0..len), for the shell's
+ *     hash tables keyed by names
+ */
+unsigned int fnvhash(const char *s, size_t len){
+    unsigned int h = 2166136261u;
+
+    while(len--){
+        h = (h ^ (unsigned char)*s++) * 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief racy Tell whether what was read from a file or directory can't
+ *     be reused on the strength of its mtime: a change within the same
+ *     timestamp tick wouldn't move it
+ * @param st The stat taken before reading it
+ * @return 1 if it changed within the last second
+ */
+int racy(const struct stat *st){
+    return st->st_mtim.tv_sec >= time(NULL) - 1;
 }
 
 /**
@@ -709,13 +4189,13 @@ int Sigaddset(sigset_t *set, int signal){
  * @brief Sigprocmask Wrapper function for sigprocmask
  * @param action The action to be carried on the set
  * @param set The signal set on which the action is to be done
- * @param t NULL
+ * @param t Receives the previous mask, unless NULL
  * @return  0 if success, -1 if error
  */
 int Sigprocmask(int action, sigset_t* set, void* t){
     int status;                                                                             //The status if the function
 
-    if((status = sigprocmask(action, set, NULL))){                                          //If sigprocmask fails
+    if((status = sigprocmask(action, set, t))){                                             //If sigprocmask fails
         unix_error("Fatal: Sigprocmask Error!");                                            //throw error
     }
 